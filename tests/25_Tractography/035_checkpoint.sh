@@ -0,0 +1,14 @@
+#@desc Checking that an interrupted tractography run can be resumed from its checkpoint
+${TRACTOR} mkroi $TRACTOR_TEST_DATA/session@FA 50 59 33 Width:3 ROIName:region
+${TRACTOR} track $TRACTOR_TEST_DATA/session region PreferredModel:dti JitterSeeds:false Streamlines:200x RequirePaths:true TractName:full
+setsid ${TRACTOR} track $TRACTOR_TEST_DATA/session region PreferredModel:dti JitterSeeds:false Streamlines:200x RequirePaths:true TractName:resumed CheckpointInterval:500 >/dev/null 2>&1 &
+pid=$!
+while kill -0 $pid 2>/dev/null && test ! -f resumed.ckpt; do sleep 0.01; done
+kill -9 -- -$pid 2>/dev/null
+wait $pid 2>/dev/null
+${TRACTOR} track $TRACTOR_TEST_DATA/session region PreferredModel:dti JitterSeeds:false Streamlines:200x RequirePaths:true TractName:resumed CheckpointInterval:500
+cmp -s full.trk resumed.trk && echo "Streamline files match"
+${TRACTOR} value full 50 59 33 | sed 's/"full"/"tract"/' >full.txt
+${TRACTOR} value resumed 50 59 33 | sed 's/"resumed"/"tract"/' >resumed.txt
+cmp -s full.txt resumed.txt && echo "Visitation maps match"
+test -f resumed.ckpt || echo "Checkpoint removed"
@@ -0,0 +1,12 @@
+#@desc Checking that merged shards match a single tractography run
+${TRACTOR} track $TRACTOR_TEST_DATA/session 50 59 33 Strategy:voxelwise Streamlines:50x RequirePaths:true TractName:single Shard:1/1
+${TRACTOR} trkmerge single_50_59_33 Shards:1
+for i in 1 2 3; do
+    ${TRACTOR} track $TRACTOR_TEST_DATA/session 50 59 33 Strategy:voxelwise Streamlines:50x RequirePaths:true TractName:sharded Shard:$i/3
+    ${TRACTOR} -v1 trkinfo sharded_50_59_33_shard$i | grep Number
+done
+${TRACTOR} trkmerge sharded_50_59_33 Shards:3
+cmp -s single_50_59_33.trk sharded_50_59_33.trk && echo "Streamline files match"
+${TRACTOR} value single_50_59_33 50 59 33 | sed 's/"single_/"/' >single.txt
+${TRACTOR} value sharded_50_59_33 50 59 33 | sed 's/"sharded_/"/' >sharded.txt
+cmp -s single.txt sharded.txt && echo "Visitation maps match"
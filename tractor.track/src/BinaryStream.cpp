@@ -2,6 +2,11 @@
 
 #include "BinaryStream.h"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 // NB: templated methods are defined inline in the header
 
 void BinaryStream::setEndianness (const std::string &endianness)
@@ -53,3 +58,24 @@ void BinaryOutputStream::writeString (const std::string &value, const bool termi
         write<char>(&nul);
     }
 }
+
+void BinaryOutputStream::sync ()
+{
+    outputStream->flush();
+    if (!outputStream->good())
+        throw std::runtime_error("Failed to flush output stream");
+    
+#ifndef _WIN32
+    // The stream doesn't expose its file descriptor, but syncing through
+    // another one commits the same file's data
+    if (!path.empty())
+    {
+        const int fd = ::open(path.c_str(), O_WRONLY);
+        if (fd >= 0)
+        {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+#endif
+}
@@ -68,20 +68,31 @@ public:
 
 class BinaryOutputStream : public BinaryStream
 {
+protected:
+    std::string path;
+    
 public:
     BinaryOutputStream ()                           { }
     BinaryOutputStream (std::ofstream *stream)      { attach(stream); }
     BinaryOutputStream (const std::string &path)    { attach(path); }
     
     void attach (std::ofstream *stream) { this->outputStream = stream; }
-    void attach (const std::string &path)
+    
+    // If "preserve" is true, an existing file is opened for update rather than truncated
+    void attach (const std::string &path, const bool preserve = false)
     {
-        this->outputStream = new std::ofstream(path, std::ios::out | std::ios::binary);
+        const std::ios::openmode mode = (preserve ? std::ios::in | std::ios::out : std::ios::out) | std::ios::binary;
+        this->outputStream = new std::ofstream(path, mode);
         if (!outputStream)
             throw std::runtime_error("Failed to open file " + path);
         this->streamsOwned = true;
+        this->path = path;
     }
     
+    // Flush buffered data to the file and, if the stream was opened by path
+    // on a POSIX system, ask the OS to commit it to disk
+    void sync ();
+    
     template <typename TargetType> void writeValue (const TargetType &value);
     template <typename TargetType> void writeValues (const TargetType &value, size_t n);
     template <typename TargetType> void writeArray (TargetType * const pointer, size_t n);
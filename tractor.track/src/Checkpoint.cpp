@@ -0,0 +1,83 @@
+#include <Rcpp.h>
+
+#include "Checkpoint.h"
+
+void CheckpointDataSink::write ()
+{
+    // Make sure R's copy of the RNG state is current
+    PutRNGstate();
+    Rcpp::Environment globalEnv = Rcpp::Environment::global_env();
+    std::vector<int> seed;
+    if (globalEnv.exists(".Random.seed"))
+        seed = Rcpp::as<std::vector<int>>(globalEnv.get(".Random.seed"));
+    
+    // Write to a temporary file first, so that an interruption while writing
+    // doesn't destroy the previous checkpoint
+    const std::string tempPath = path + ".tmp";
+    {
+        BinaryOutputStream outputStream(tempPath);
+        
+        // Magic number (unterminated) and version
+        outputStream.writeString("TRKCHKPT", false);
+        outputStream.writeValue<int32_t>(2);
+        
+        outputStream.writeValue<uint64_t>(totalStreamlines);
+        outputStream.writeValue<int32_t>(seed.size());
+        if (!seed.empty())
+            outputStream.writeVector<int32_t>(seed);
+        
+        outputStream.writeValue<int32_t>(components.size());
+        for (Checkpointable *component : components)
+        {
+            outputStream.writeString(component->stateTag());
+            component->saveState(outputStream);
+        }
+        outputStream.sync();
+    }
+    
+    // Replacing an existing file fails on some platforms
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        std::remove(path.c_str());
+        if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("Failed to write checkpoint file " + path);
+    }
+    
+    lastCheckpoint = totalStreamlines;
+}
+
+void CheckpointDataSink::restore ()
+{
+    BinaryInputStream inputStream(path);
+    inputStream.setEndianness("native");
+    
+    if (inputStream.readString(8) != "TRKCHKPT")
+        throw std::runtime_error("Checkpoint file does not seem to have a valid magic number");
+    if (inputStream.readValue<int32_t>() != 2)
+        throw std::runtime_error("Checkpoint file version is not supported");
+    
+    totalStreamlines = lastCheckpoint = resumedStreamlines = inputStream.readValue<uint64_t,size_t>();
+    
+    std::vector<int> seed;
+    const int seedLength = inputStream.readValue<int32_t>();
+    if (seedLength > 0)
+        inputStream.readVector<int32_t>(seed, seedLength);
+    
+    const int nComponents = inputStream.readValue<int32_t>();
+    if (nComponents != static_cast<int>(components.size()))
+        throw std::runtime_error("Checkpoint does not match the current pipeline");
+    for (Checkpointable *component : components)
+    {
+        if (inputStream.readString() != component->stateTag())
+            throw std::runtime_error("Checkpoint does not match the current pipeline");
+        component->restoreState(inputStream);
+    }
+    
+    // Restore the RNG state last, and reload it into R's generator
+    if (!seed.empty())
+    {
+        Rcpp::Environment globalEnv = Rcpp::Environment::global_env();
+        globalEnv.assign(".Random.seed", Rcpp::IntegerVector(seed.begin(), seed.end()));
+        GetRNGstate();
+    }
+}
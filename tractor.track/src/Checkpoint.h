@@ -0,0 +1,75 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include "DataSource.h"
+#include "BinaryStream.h"
+#include "Streamline.h"
+
+// Interface for pipeline components whose progress can be saved to a
+// checkpoint and restored later, so that an interrupted run can be continued
+// where it left off. State is saved between blocks, when nothing is in flight
+class Checkpointable
+{
+public:
+    virtual ~Checkpointable () {}
+    
+    // A short tag identifying the kind of state, which is checked on restore
+    virtual std::string stateTag () const = 0;
+    
+    virtual void saveState (BinaryOutputStream &stream) const = 0;
+    virtual void restoreState (BinaryInputStream &stream) = 0;
+};
+
+// Periodically writes the state of the pipeline's source, its other sinks and
+// R's random number generator to file. This must be the last sink in the
+// pipeline, so that earlier sinks have finished with each block before the
+// checkpoint is written. The file is replaced atomically, and removed once
+// the pipeline completes
+class CheckpointDataSink : public DataSink<Streamline>
+{
+private:
+    std::string path;
+    size_t interval;
+    std::vector<Checkpointable*> components;
+    
+    size_t totalStreamlines = 0, lastCheckpoint = 0, resumedStreamlines = 0;
+    
+    void write ();
+    
+public:
+    // Delete the default constructor
+    CheckpointDataSink () = delete;
+    
+    // Streamlines are counted as they reach the sinks, and a checkpoint is
+    // written after the first block that takes the count "interval" or more
+    // past the last one. The components are not owned by this object
+    CheckpointDataSink (const std::string &path, const size_t interval, const std::vector<Checkpointable*> &components)
+        : path(path), interval(interval), components(components) {}
+    
+    // Whether a checkpoint exists at the specified path
+    static bool exists (const std::string &path)
+    {
+        return std::ifstream(path).good();
+    }
+    
+    // Restore all components, and the RNG state, from the checkpoint file
+    void restore ();
+    
+    // The number of streamlines that had been written when the restored checkpoint was saved
+    size_t resumed () const { return resumedStreamlines; }
+    
+    void put (const Streamline &data) override { totalStreamlines++; }
+    
+    void finish () override
+    {
+        if (totalStreamlines - lastCheckpoint >= interval)
+            write();
+    }
+    
+    void done () override
+    {
+        std::remove(path.c_str());
+    }
+};
+
+#endif
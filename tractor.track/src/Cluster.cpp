@@ -0,0 +1,77 @@
+#include <Rcpp.h>
+
+#include "Cluster.h"
+
+void StreamlineClusterDataSink::put (const Streamline &data)
+{
+    if (!haveSpace)
+    {
+        if (!data.hasImageSpace())
+            throw std::runtime_error("Streamline has no image space information");
+        space = ImageSpace(data.imageSpace()->dim, data.imageSpace()->pixdim, data.imageSpace()->transform);
+        pointType = (data.getPointType() == PointType::World ? PointType::World : PointType::Scaled);
+        haveSpace = true;
+    }
+    else if ((data.getPointType() == PointType::World) != (pointType == PointType::World))
+        throw std::runtime_error("Point types do not match across streamlines, so they cannot be clustered together");
+    
+    resampleStreamline(data, nPoints, current.data());
+    
+    // Find the nearest centroid, tightening the bound as we go so that
+    // distant clusters can be abandoned early
+    const size_t stride = 3 * nPoints;
+    const size_t n = sizes.size();
+    float bestDistance = static_cast<float>(threshold);
+    size_t bestCluster = n;
+    bool bestFlipped = false;
+    for (size_t i=0; i<n; i++)
+    {
+        bool flipped;
+        const float distance = mdfDistance(current.data(), &centroids[i*stride], nPoints, &flipped, bestDistance);
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            bestCluster = i;
+            bestFlipped = flipped;
+        }
+    }
+    
+    if (bestCluster == n)
+    {
+        centroids.insert(centroids.end(), current.begin(), current.end());
+        sizes.push_back(1);
+    }
+    else
+    {
+        // Update the running mean, aligning the streamline with the centroid
+        float *centroid = &centroids[bestCluster*stride];
+        const size_t size = ++sizes[bestCluster];
+        for (size_t k=0; k<nPoints; k++)
+        {
+            const float *point = &current[3 * (bestFlipped ? nPoints-k-1 : k)];
+            for (int j=0; j<3; j++)
+                centroid[3*k+j] += (point[j] - centroid[3*k+j]) / size;
+        }
+    }
+    
+    if (bestCluster > static_cast<size_t>(std::numeric_limits<int>::max()))
+        throw std::runtime_error("Too many clusters to index");
+    membership.push_back(static_cast<int>(bestCluster));
+}
+
+std::vector<Streamline> StreamlineClusterDataSink::getCentroids ()
+{
+    std::vector<Streamline> result;
+    const size_t stride = 3 * nPoints;
+    for (size_t i=0; i<sizes.size(); i++)
+    {
+        std::vector<ImageSpace::Point> points(nPoints);
+        for (size_t k=0; k<nPoints; k++)
+        {
+            for (int j=0; j<3; j++)
+                points[k][j] = static_cast<ImageSpace::Element>(centroids[i*stride + 3*k + j]);
+        }
+        result.push_back(Streamline(std::vector<ImageSpace::Point>(1, points[0]), points, pointType, &space, false));
+    }
+    return result;
+}
@@ -0,0 +1,59 @@
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include "DataSource.h"
+#include "Streamline.h"
+#include "Distance.h"
+
+// Groups streamlines as they arrive using the QuickBundles algorithm
+// (Garyfallidis et al., 2012): each streamline joins the cluster with the
+// nearest centroid, by MDF distance, if that is within the threshold, and
+// otherwise starts a new cluster. Only the centroids are held in memory, plus
+// one cluster index per streamline
+class StreamlineClusterDataSink : public DataSink<Streamline>
+{
+private:
+    double threshold;
+    size_t nPoints;
+    
+    // Centroids are running means, stored contiguously with 3*nPoints
+    // coordinates per cluster
+    std::vector<float> centroids;
+    std::vector<size_t> sizes;
+    std::vector<int> membership;
+    
+    // Working storage for the current streamline
+    std::vector<float> current;
+    
+    // The space and point type of the centroids, from the first streamline
+    ImageSpace space;
+    PointType pointType;
+    bool haveSpace = false;
+    
+public:
+    StreamlineClusterDataSink (const double threshold, const size_t nPoints = 12)
+        : threshold(threshold), nPoints(nPoints), current(3 * nPoints)
+    {
+        if (nPoints < 2)
+            throw std::runtime_error("At least two points are needed to represent each streamline");
+    }
+    
+    void setup (const size_t &count) override
+    {
+        if (count > 0)
+            membership.reserve(membership.size() + count);
+    }
+    
+    void put (const Streamline &data) override;
+    
+    size_t nClusters () const { return sizes.size(); }
+    const std::vector<size_t> & getSizes () const { return sizes; }
+    
+    // Cluster indices, zero-based, in the order that streamlines were received
+    const std::vector<int> & getMembership () const { return membership; }
+    
+    // Centroids as streamlines in real-world units, with the seed at the start
+    std::vector<Streamline> getCentroids ();
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include <Rcpp.h>
+
+#include "BinaryStream.h"
+#include "Connectivity.h"
+
+void ConnectivityMatrixDataSink::put (const Streamline &data)
+{
+    const int seedId = data.getSeedId();
+    if (seedId < 0 || static_cast<size_t>(seedId) >= seeds.size())
+        throw std::runtime_error("Streamline does not have a valid seed ID");
+    
+    totals[seedId]++;
+    
+    std::vector<std::pair<int,uint32_t>> &row = rows[seedId];
+    for (const int &label : data.getLabels())
+    {
+        auto it = std::lower_bound(row.begin(), row.end(), std::make_pair(label, uint32_t(0)));
+        if (it != row.end() && it->first == label)
+            it->second++;
+        else
+            row.insert(it, std::make_pair(label, uint32_t(1)));
+    }
+}
+
+void ConnectivityMatrixDataSink::getElements (std::vector<int> &seedIndices, std::vector<int> &labels, std::vector<int> &counts) const
+{
+    seedIndices.clear();
+    labels.clear();
+    counts.clear();
+    for (size_t i=0; i<rows.size(); i++)
+    {
+        for (const std::pair<int,uint32_t> &element : rows[i])
+        {
+            seedIndices.push_back(static_cast<int>(i));
+            labels.push_back(element.first);
+            counts.push_back(static_cast<int>(std::min(element.second, static_cast<uint32_t>(std::numeric_limits<int>::max()))));
+        }
+    }
+}
+
+void ConnectivityMatrixDataSink::read (const std::string &path)
+{
+    BinaryInputStream inputStream(path);
+    
+    if (inputStream.readString(8) != "TRKCONMX")
+        throw std::runtime_error("Connectivity matrix file does not seem to have a valid magic number");
+    
+    const int version = inputStream.readValue<int32_t>();
+    inputStream.setEndianness(version < 0 || version > 0xffff ? "swapped" : "native");
+    
+    const int nSeeds = inputStream.readValue<int32_t>();
+    const int nLabels = inputStream.readValue<int32_t>();
+    const size_t nElements = inputStream.readValue<uint64_t,size_t>();
+    inputStream->seekg(32);
+    
+    dictionary.clear();
+    for (int i=0; i<nLabels; i++)
+    {
+        const int value = inputStream.readValue<int32_t>();
+        dictionary[value] = inputStream.readString();
+    }
+    
+    seeds.resize(nSeeds);
+    for (int i=0; i<nSeeds; i++)
+        inputStream.readPoint<float>(seeds[i]);
+    
+    totals.resize(nSeeds);
+    std::vector<size_t> offsets(nSeeds + 1);
+    std::vector<int> labels(nElements);
+    std::vector<uint32_t> counts(nElements);
+    if (nSeeds > 0)
+        inputStream.readVector<uint32_t>(totals);
+    inputStream.readVector<uint64_t>(offsets);
+    if (nElements > 0)
+    {
+        inputStream.readVector<int32_t>(labels);
+        inputStream.readVector<uint32_t>(counts);
+    }
+    
+    rows.assign(nSeeds, std::vector<std::pair<int,uint32_t>>());
+    for (int i=0; i<nSeeds; i++)
+    {
+        if (offsets[i] > offsets[i+1] || offsets[i+1] > nElements)
+            throw std::runtime_error("Connectivity matrix file contains invalid offsets");
+        for (size_t j=offsets[i]; j<offsets[i+1]; j++)
+            rows[i].push_back(std::make_pair(labels[j], counts[j]));
+    }
+}
+
+void ConnectivityMatrixDataSink::write (const std::string &path) const
+{
+    std::vector<uint64_t> offsets(1, 0);
+    std::vector<int32_t> labels;
+    std::vector<uint32_t> counts;
+    for (const auto &row : rows)
+    {
+        for (const std::pair<int,uint32_t> &element : row)
+        {
+            labels.push_back(element.first);
+            counts.push_back(element.second);
+        }
+        offsets.push_back(labels.size());
+    }
+    
+    BinaryOutputStream outputStream(path);
+    
+    // Magic number (unterminated)
+    outputStream.writeString("TRKCONMX", false);
+    
+    // File version number (offset 8)
+    outputStream.writeValue<int32_t>(1);
+    
+    // Number of seeds (offset 12)
+    outputStream.writeValue<int32_t>(seeds.size());
+    
+    // Number of labels in the dictionary (offset 16)
+    outputStream.writeValue<int32_t>(dictionary.size());
+    
+    // Number of nonzero elements (offset 20)
+    outputStream.writeValue<uint64_t>(labels.size());
+    
+    // 4 bytes' padding for future versions (offset 28)
+    outputStream.writeValue<int32_t>(0);
+    
+    // Write out label dictionary (offset 32)
+    for (auto it=dictionary.cbegin(); it!=dictionary.cend(); it++)
+    {
+        outputStream.writeValue<int32_t>(it->first);
+        outputStream.writeString(it->second);
+    }
+    
+    // Seed points, streamline totals per seed, then the matrix in CSR form,
+    // with row offsets, labels and counts (variable offset)
+    for (const ImageSpace::Point &seed : seeds)
+        outputStream.writePoint<float>(seed);
+    if (!totals.empty())
+        outputStream.writeVector<uint32_t>(totals);
+    outputStream.writeVector<uint64_t>(offsets);
+    if (!labels.empty())
+    {
+        outputStream.writeVector<int32_t>(labels);
+        outputStream.writeVector<uint32_t>(counts);
+    }
+}
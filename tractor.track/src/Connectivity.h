@@ -0,0 +1,40 @@
+#ifndef _CONNECTIVITY_H_
+#define _CONNECTIVITY_H_
+
+#include "DataSource.h"
+#include "Streamline.h"
+
+// Counts, for each seed point, the streamlines generated from it that reach
+// each target label. The seed is identified by the seed ID set by the tracker
+// source. Each seed's row is a short vector of (label, count) pairs, sorted
+// by label, so the matrix stays sparse however many seeds there are
+class ConnectivityMatrixDataSink : public DataSink<Streamline>
+{
+private:
+    std::vector<ImageSpace::Point> seeds;
+    std::map<int,std::string> dictionary;
+    std::vector<uint32_t> totals;
+    std::vector<std::vector<std::pair<int,uint32_t>>> rows;
+    
+public:
+    ConnectivityMatrixDataSink () {}
+    
+    explicit ConnectivityMatrixDataSink (const std::vector<ImageSpace::Point> &seeds)
+        : seeds(seeds), totals(seeds.size(), 0), rows(seeds.size()) {}
+    
+    std::map<int,std::string> & labelDictionary () { return dictionary; }
+    const std::vector<ImageSpace::Point> & getSeeds () const { return seeds; }
+    const std::vector<uint32_t> & getTotals () const { return totals; }
+    
+    void put (const Streamline &data) override;
+    
+    // Nonzero elements as (seed, label, count) triplets, with zero-based
+    // seed indices, in seed order
+    void getElements (std::vector<int> &seedIndices, std::vector<int> &labels, std::vector<int> &counts) const;
+    
+    // Compact binary storage, with rows in compressed sparse form
+    void read (const std::string &path);
+    void write (const std::string &path) const;
+};
+
+#endif
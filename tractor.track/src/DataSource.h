@@ -18,11 +18,22 @@ public:
     // available from the source (or 0 if this is unknown), more() is used to
     // check if more elements are available, get() retrieves an element, seek()
     // moves to the nth element if seekable() returns true to say seeking is
-    // allowed, and done() is called after the pipeline finishes
+    // allowed, and done() is called after the pipeline finishes. If discard()
+    // returns true after a call to get(), the element just retrieved is
+    // dropped without being passed to any manipulators or sinks
     virtual void setup () {}
     virtual size_t count () { return 0; }
     virtual bool more () { return false; }
     virtual void get (ElementType &data) {}
+    virtual bool discard () { return false; }
+    
+    // Sources that need feedback from the pipeline can suggest how many
+    // elements should be retrieved in the next block, and are told through
+    // accept() how many elements of each block survived the manipulators.
+    // The return value is the number of those elements to keep, with any
+    // surplus being dropped from the end of the block
+    virtual size_t preferredBlockSize (const size_t blockSize) { return blockSize; }
+    virtual size_t accept (const size_t n) { return n; }
     virtual void seek (const size_t n) {}
     virtual bool seekable () { return false; }
     virtual void done () {}
@@ -50,8 +61,12 @@ public:
     virtual ~DataManipulator () {}
     
     // If the return value is false, the element will be removed
+    // The flush() function is called once after the last element has been
+    // processed; if it returns true, the data it sets is added to the end of
+    // the working set, and passed on to later manipulators and sinks
     virtual void setup (const size_t &count) {}
     virtual bool process (ElementType &data) { return true; }
+    virtual bool flush (ElementType &data) { return false; }
 };
 
 #endif
@@ -7,7 +7,7 @@ DiffusionTensorModel::DiffusionTensorModel (const std::string &pdFile)
     RNifti::NiftiImage image(pdFile);
     image.reorient("LAS");
     space = new ImageSpace(image);
-    principalDirections = new Image<ImageSpace::Vector,3>(image);
+    principalDirections = new Image<ImageSpace::Vector,3,TrackingLayout>(image);
 }
 
 ImageSpace::Vector DiffusionTensorModel::sampleDirection (const ImageSpace::Point &point, const ImageSpace::Vector &referenceDirection) const
@@ -15,6 +15,14 @@ ImageSpace::Vector DiffusionTensorModel::sampleDirection (const ImageSpace::Poin
     return principalDirections->at(point, PointType::Voxel, RoundingType::Probabilistic);
 }
 
+DiffusionModel * DiffusionTensorModel::crop (const ImageSpace::DimVector &origin, const ImageSpace::DimVector &extent) const
+{
+    DiffusionTensorModel *result = new DiffusionTensorModel;
+    result->principalDirections = principalDirections->crop(origin, extent);
+    result->copyImageSpace(*result->principalDirections);
+    return result;
+}
+
 BedpostModel::BedpostModel (const std::vector<std::string> &avfFiles, const std::vector<std::string> &thetaFiles, const std::vector<std::string> &phiFiles)
     : avfThreshold(0.05)
 {
@@ -30,20 +38,36 @@ BedpostModel::BedpostModel (const std::vector<std::string> &avfFiles, const std:
     
     for (int i=0; i<nCompartments; i++)
     {
-        avf[i] = new Image<float,4>(RNifti::NiftiImage(avfFiles[i]).reorient("LAS"));
-        theta[i] = new Image<float,4>(RNifti::NiftiImage(thetaFiles[i]).reorient("LAS"));
-        phi[i] = new Image<float,4>(RNifti::NiftiImage(phiFiles[i]).reorient("LAS"));
+        avf[i] = new Image<float,4,TrackingLayout>(RNifti::NiftiImage(avfFiles[i]).reorient("LAS"));
+        theta[i] = new Image<float,4,TrackingLayout>(RNifti::NiftiImage(thetaFiles[i]).reorient("LAS"));
+        phi[i] = new Image<float,4,TrackingLayout>(RNifti::NiftiImage(phiFiles[i]).reorient("LAS"));
     }
     
     copyImageSpace(*avf[0]);
     nSamples = avf[0]->dim()[3];
 }
 
+DiffusionModel * BedpostModel::crop (const ImageSpace::DimVector &origin, const ImageSpace::DimVector &extent) const
+{
+    BedpostModel *result = new BedpostModel;
+    result->nCompartments = nCompartments;
+    result->nSamples = nSamples;
+    result->avfThreshold = avfThreshold;
+    for (int i=0; i<nCompartments; i++)
+    {
+        result->avf.push_back(avf[i]->crop(origin, extent));
+        result->theta.push_back(theta[i]->crop(origin, extent));
+        result->phi.push_back(phi[i]->crop(origin, extent));
+    }
+    result->copyImageSpace(*result->avf[0]);
+    return result;
+}
+
 ImageSpace::Vector BedpostModel::sampleDirection (const ImageSpace::Point &point, const ImageSpace::Vector &referenceDirection) const
 {
     // Round the point location and convert to array index
     ImageSpace::Point roundedPoint = space->toVoxel(point, PointType::Voxel, RoundingType::Probabilistic);
-    Image<float,4>::ArrayIndex loc;
+    Image<float,4,TrackingLayout>::ArrayIndex loc;
     for (int i=0; i<3; i++)
         loc[i] = static_cast<size_t>(roundedPoint[i]);
     
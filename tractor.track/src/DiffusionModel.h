@@ -3,6 +3,10 @@
 
 #include "Image.h"
 
+// Images read at every tracking step use a bricked layout, so that steps in
+// any direction tend to stay within the same few cache lines
+template <int Dimensionality> using TrackingLayout = Bricked8Layout<Dimensionality>;
+
 class DiffusionModel : public ImageSpaceEmbedded
 {
 public:
@@ -12,12 +16,19 @@ public:
     {
         return ImageSpace::zeroVector();
     }
+    
+    // A new model covering only the specified block of voxels, or NULL if
+    // the model can't be cropped. The caller takes ownership
+    virtual DiffusionModel * crop (const ImageSpace::DimVector &origin, const ImageSpace::DimVector &extent) const
+    {
+        return nullptr;
+    }
 };
 
 class DiffusionTensorModel : public DiffusionModel
 {
 private:
-    Image<ImageSpace::Vector,3> *principalDirections;
+    Image<ImageSpace::Vector,3,TrackingLayout> *principalDirections;
     
 public:
     DiffusionTensorModel ()
@@ -31,12 +42,13 @@ public:
     }
     
     ImageSpace::Vector sampleDirection (const ImageSpace::Point &point, const ImageSpace::Vector &referenceDirection) const override;
+    DiffusionModel * crop (const ImageSpace::DimVector &origin, const ImageSpace::DimVector &extent) const override;
 };
 
 class BedpostModel : public DiffusionModel
 {
 private:
-    std::vector<Image<float,4>*> avf, theta, phi;
+    std::vector<Image<float,4,TrackingLayout>*> avf, theta, phi;
     int nCompartments = 0;
     int nSamples = 0;
     float avfThreshold = 0.0;
@@ -63,6 +75,7 @@ public:
     void setAvfThreshold (const float avfThreshold) { this->avfThreshold = avfThreshold; }
     
     ImageSpace::Vector sampleDirection (const ImageSpace::Point &point, const ImageSpace::Vector &referenceDirection) const override;
+    DiffusionModel * crop (const ImageSpace::DimVector &origin, const ImageSpace::DimVector &extent) const override;
 };
 
 #endif
@@ -0,0 +1,264 @@
+#include <Rcpp.h>
+
+#include "Distance.h"
+
+#include <thread>
+
+void resampleStreamline (const Streamline &streamline, const size_t n, float *result)
+{
+    if (!streamline.hasImageSpace())
+        throw std::runtime_error("Streamline has no image space information");
+    
+    // Voxel points are scaled so that distances are in real-world units
+    std::vector<ImageSpace::Point> points = streamline.getPoints();
+    if (streamline.getPointType() == PointType::Voxel)
+        streamline.imageSpace()->fromVoxel(points, PointType::Scaled);
+    
+    const size_t nPoints = points.size();
+    if (nPoints == 0)
+        throw std::runtime_error("Streamline contains no points");
+    else if (nPoints == 1 || n == 1)
+    {
+        for (size_t k=0; k<n; k++)
+        {
+            for (int j=0; j<3; j++)
+                result[3*k+j] = static_cast<float>(points[0][j]);
+        }
+        return;
+    }
+    
+    std::vector<double> distances(nPoints, 0.0);
+    for (size_t i=1; i<nPoints; i++)
+        distances[i] = distances[i-1] + static_cast<double>(ImageSpace::norm(ImageSpace::step(points[i-1], points[i])));
+    
+    const double step = distances.back() / (n - 1);
+    size_t segment = 1;
+    for (size_t k=0; k<n; k++)
+    {
+        const double target = k * step;
+        while (segment < nPoints - 1 && distances[segment] < target)
+            segment++;
+        
+        const double segmentLength = distances[segment] - distances[segment-1];
+        const double fraction = (segmentLength > 0.0 ? std::min((target - distances[segment-1]) / segmentLength, 1.0) : 0.0);
+        for (int j=0; j<3; j++)
+            result[3*k+j] = static_cast<float>(points[segment-1][j] + fraction * (points[segment][j] - points[segment-1][j]));
+    }
+}
+
+void meanPointwiseDistances (const float *first, const float *second, const size_t n, float &direct, float &flipped, const float bound)
+{
+    // Bounds are checked every few points, so that the inner loop stays simple
+    const size_t chunkSize = 4;
+    const float totalBound = bound * n;
+    
+    float directSum = 0.0f, flippedSum = 0.0f;
+    for (size_t start=0; start<n; start+=chunkSize)
+    {
+        const size_t end = std::min(start + chunkSize, n);
+        for (size_t k=start; k<end; k++)
+        {
+            const float *a = first + 3*k;
+            const float *b = second + 3*k;
+            const float *c = second + 3*(n-k-1);
+            const float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+            const float fx = a[0] - c[0], fy = a[1] - c[1], fz = a[2] - c[2];
+            directSum += std::sqrt(dx*dx + dy*dy + dz*dz);
+            flippedSum += std::sqrt(fx*fx + fy*fy + fz*fz);
+        }
+        
+        if (bound > 0.0f && directSum > totalBound && flippedSum > totalBound)
+            break;
+    }
+    
+    direct = directSum / n;
+    flipped = flippedSum / n;
+}
+
+const size_t StreamlineDistanceCalculator::tileSize;
+
+// Mean (for MAM) or maximum (for Hausdorff) over the points of the first
+// streamline of the distance to the closest point of the second
+static float closestPointDistance (const float *first, const float *second, const size_t n, const bool maximum)
+{
+    float result = 0.0f;
+    for (size_t k=0; k<n; k++)
+    {
+        const float *a = first + 3*k;
+        float minSquared = std::numeric_limits<float>::max();
+        for (size_t l=0; l<n; l++)
+        {
+            const float *b = second + 3*l;
+            const float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+            minSquared = std::min(minSquared, dx*dx + dy*dy + dz*dz);
+        }
+        const float minDistance = std::sqrt(minSquared);
+        result = maximum ? std::max(result, minDistance) : result + minDistance;
+    }
+    return maximum ? result : result / n;
+}
+
+float StreamlineDistanceCalculator::distance (const float *first, const float *second, const size_t n, const float bound) const
+{
+    switch (metric)
+    {
+        case DistanceMetric::MDF:
+        return mdfDistance(first, second, n, nullptr, bound);
+        
+        case DistanceMetric::MAM:
+        return 0.5f * (closestPointDistance(first, second, n, false) + closestPointDistance(second, first, n, false));
+        
+        case DistanceMetric::Hausdorff:
+        return std::max(closestPointDistance(first, second, n, true), closestPointDistance(second, first, n, true));
+    }
+    
+    return 0.0f;
+}
+
+template <class Function>
+void StreamlineDistanceCalculator::forEachRowRange (const size_t nRows, Function function) const
+{
+    const size_t nWorkers = std::min(nThreads, std::max(nRows, size_t(1)));
+    if (nWorkers == 1)
+    {
+        function(size_t(0), size_t(0), nRows);
+        return;
+    }
+    
+    const size_t rowsPerWorker = (nRows + nWorkers - 1) / nWorkers;
+    std::vector<std::thread> workers;
+    for (size_t t=0; t<nWorkers; t++)
+    {
+        const size_t start = std::min(t * rowsPerWorker, nRows);
+        const size_t end = std::min(start + rowsPerWorker, nRows);
+        workers.push_back(std::thread(function, t, start, end));
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+template <class Function>
+void StreamlineDistanceCalculator::forEachPair (const size_t startRow, const size_t endRow, const size_t nCols, Function function) const
+{
+    for (size_t rowTile=startRow; rowTile<endRow; rowTile+=tileSize)
+    {
+        const size_t rowTileEnd = std::min(rowTile + tileSize, endRow);
+        for (size_t colTile=0; colTile<nCols; colTile+=tileSize)
+        {
+            const size_t colTileEnd = std::min(colTile + tileSize, nCols);
+            for (size_t i=rowTile; i<rowTileEnd; i++)
+            {
+                for (size_t j=colTile; j<colTileEnd; j++)
+                    function(i, j);
+            }
+        }
+    }
+}
+
+static void checkCompatible (const ResampledStreamlineDataSink &first, const ResampledStreamlineDataSink &second)
+{
+    if (first.pointsPerStreamline() != second.pointsPerStreamline())
+        throw std::runtime_error("Streamline sets must be resampled to the same number of points");
+}
+
+std::vector<double> StreamlineDistanceCalculator::matrix (const ResampledStreamlineDataSink &first, const ResampledStreamlineDataSink &second) const
+{
+    checkCompatible(first, second);
+    const size_t nRows = first.size(), nCols = second.size(), n = first.pointsPerStreamline();
+    
+    // Each element is written by exactly one thread
+    std::vector<double> result(nRows * nCols);
+    forEachRowRange(nRows, [&](const size_t thread, const size_t start, const size_t end) {
+        forEachPair(start, end, nCols, [&](const size_t i, const size_t j) {
+            result[i + j * nRows] = static_cast<double>(distance(first[i], second[j], n));
+        });
+    });
+    return result;
+}
+
+void StreamlineDistanceCalculator::thresholded (const ResampledStreamlineDataSink &first, const ResampledStreamlineDataSink &second, const double threshold, std::vector<int> &rows, std::vector<int> &cols, std::vector<double> &distances) const
+{
+    checkCompatible(first, second);
+    const size_t nRows = first.size(), nCols = second.size(), n = first.pointsPerStreamline();
+    const float bound = static_cast<float>(threshold);
+    
+    struct Matches { std::vector<int> rows, cols; std::vector<double> distances; };
+    std::vector<Matches> matches(nThreads);
+    forEachRowRange(nRows, [&](const size_t thread, const size_t start, const size_t end) {
+        Matches &local = matches[thread];
+        forEachPair(start, end, nCols, [&](const size_t i, const size_t j) {
+            const float value = distance(first[i], second[j], n, bound);
+            if (value <= bound)
+            {
+                local.rows.push_back(static_cast<int>(i));
+                local.cols.push_back(static_cast<int>(j));
+                local.distances.push_back(static_cast<double>(value));
+            }
+        });
+    });
+    
+    rows.clear();
+    cols.clear();
+    distances.clear();
+    for (const Matches &local : matches)
+    {
+        rows.insert(rows.end(), local.rows.begin(), local.rows.end());
+        cols.insert(cols.end(), local.cols.begin(), local.cols.end());
+        distances.insert(distances.end(), local.distances.begin(), local.distances.end());
+    }
+}
+
+void StreamlineDistanceCalculator::nearest (const ResampledStreamlineDataSink &first, const ResampledStreamlineDataSink &second, const size_t k, std::vector<int> &indices, std::vector<double> &distances) const
+{
+    checkCompatible(first, second);
+    const size_t nRows = first.size(), nCols = second.size(), n = first.pointsPerStreamline();
+    const bool self = (&first == &second);
+    
+    indices.assign(nRows * k, -1);
+    distances.assign(nRows * k, NA_REAL);
+    if (k == 0)
+        return;
+    
+    // Each row keeps a max-heap of its best candidates so far, whose top is
+    // the bound for early termination once the heap is full
+    typedef std::pair<float,int> Candidate;
+    forEachRowRange(nRows, [&](const size_t thread, const size_t start, const size_t end) {
+        std::vector<std::vector<Candidate>> heaps(std::min(end - start, tileSize));
+        for (size_t rowTile=start; rowTile<end; rowTile+=tileSize)
+        {
+            const size_t rowTileEnd = std::min(rowTile + tileSize, end);
+            for (auto &heap : heaps)
+                heap.clear();
+            
+            forEachPair(rowTile, rowTileEnd, nCols, [&](const size_t i, const size_t j) {
+                if (self && i == j)
+                    return;
+                std::vector<Candidate> &heap = heaps[i - rowTile];
+                const float bound = (heap.size() == k ? heap.front().first : 0.0f);
+                const float value = distance(first[i], second[j], n, bound);
+                if (heap.size() < k)
+                {
+                    heap.push_back(Candidate(value, static_cast<int>(j)));
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                else if (value < heap.front().first)
+                {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = Candidate(value, static_cast<int>(j));
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            });
+            
+            for (size_t i=rowTile; i<rowTileEnd; i++)
+            {
+                std::vector<Candidate> &heap = heaps[i - rowTile];
+                std::sort_heap(heap.begin(), heap.end());
+                for (size_t l=0; l<heap.size(); l++)
+                {
+                    indices[i * k + l] = heap[l].second;
+                    distances[i * k + l] = static_cast<double>(heap[l].first);
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,112 @@
+#ifndef _DISTANCE_H_
+#define _DISTANCE_H_
+
+#include "DataSource.h"
+#include "Streamline.h"
+
+// Streamlines are compared after resampling to a fixed number of points,
+// equally spaced along their length and in real-world (typically mm) terms.
+// Coordinates are stored contiguously, as x1,y1,z1,x2,y2,z2,... so that
+// distance calculations reduce to simple loops over float arrays
+
+// Resamples the streamline, writing 3*n coordinates to the result, which must
+// be large enough to hold them
+void resampleStreamline (const Streamline &streamline, const size_t n, float *result);
+
+// Mean distance between corresponding points of two resampled streamlines,
+// taken in the same direction and with the second streamline reversed. If the
+// bound is positive, calculation may stop early once both means exceed it,
+// in which case the values are only guaranteed to be larger than the bound
+void meanPointwiseDistances (const float *first, const float *second, const size_t n, float &direct, float &flipped, const float bound = 0.0f);
+
+// The minimum average direct-flip (MDF) distance, which is symmetric with
+// respect to the direction of either streamline
+inline float mdfDistance (const float *first, const float *second, const size_t n, bool *flipped = nullptr, const float bound = 0.0f)
+{
+    float direct, reversed;
+    meanPointwiseDistances(first, second, n, direct, reversed, bound);
+    if (flipped != nullptr)
+        *flipped = (reversed < direct);
+    return std::min(direct, reversed);
+}
+
+enum struct DistanceMetric { MDF, MAM, Hausdorff };
+
+// Collects resampled streamlines from a pipeline, in one contiguous array
+class ResampledStreamlineDataSink : public DataSink<Streamline>
+{
+private:
+    size_t nPoints;
+    size_t count = 0;
+    std::vector<float> coordinates;
+    
+public:
+    explicit ResampledStreamlineDataSink (const size_t nPoints)
+        : nPoints(nPoints)
+    {
+        if (nPoints < 2)
+            throw std::runtime_error("At least two points are needed to represent each streamline");
+    }
+    
+    void setup (const size_t &count) override
+    {
+        coordinates.reserve(coordinates.size() + 3 * nPoints * count);
+    }
+    
+    void put (const Streamline &data) override
+    {
+        coordinates.resize(coordinates.size() + 3 * nPoints);
+        resampleStreamline(data, nPoints, &coordinates[3 * nPoints * count]);
+        count++;
+    }
+    
+    size_t size () const { return count; }
+    size_t pointsPerStreamline () const { return nPoints; }
+    const float * operator[] (const size_t i) const { return &coordinates[3 * nPoints * i]; }
+};
+
+// Calculates distances between two sets of resampled streamlines. Rows (the
+// first set) are divided between threads, and each thread visits pairs in
+// square tiles so that the coordinates involved stay in cache. Worker threads
+// do no R API calls, and results are combined in row order, so the output
+// does not depend on the number of threads
+class StreamlineDistanceCalculator
+{
+private:
+    DistanceMetric metric;
+    size_t nThreads;
+    
+    static const size_t tileSize = 64;
+    
+    // Calls function(thread, startRow, endRow) for a contiguous range of rows
+    // per thread, and waits for them all to finish
+    template <class Function>
+    void forEachRowRange (const size_t nRows, Function function) const;
+    
+    // Calls function(i, j) for each pair in the row range, tile by tile
+    template <class Function>
+    void forEachPair (const size_t startRow, const size_t endRow, const size_t nCols, Function function) const;
+    
+public:
+    StreamlineDistanceCalculator (const DistanceMetric metric, const size_t nThreads = 1)
+        : metric(metric), nThreads(std::max(nThreads, size_t(1))) {}
+    
+    // Distance between two resampled streamlines; for MDF, calculation may
+    // stop early if the distance exceeds a positive bound
+    float distance (const float *first, const float *second, const size_t n, const float bound = 0.0f) const;
+    
+    // Full distance matrix, column-major, with one row per streamline in
+    // the first set
+    std::vector<double> matrix (const ResampledStreamlineDataSink &first, const ResampledStreamlineDataSink &second) const;
+    
+    // Only pairs within the threshold distance, as zero-based indices
+    void thresholded (const ResampledStreamlineDataSink &first, const ResampledStreamlineDataSink &second, const double threshold, std::vector<int> &rows, std::vector<int> &cols, std::vector<double> &distances) const;
+    
+    // The k nearest neighbours in the second set of each streamline in the
+    // first, nearest first, as row-major n x k arrays. Indices are -1 where
+    // there are fewer than k candidates. If the two sets are the same object,
+    // each streamline is excluded from its own neighbours
+    void nearest (const ResampledStreamlineDataSink &first, const ResampledStreamlineDataSink &second, const size_t k, std::vector<int> &indices, std::vector<double> &distances) const;
+};
+
+#endif
@@ -59,17 +59,33 @@ protected:
     std::string path;
     
 public:
+    // The file isn't opened until open() is called, since appending to it
+    // requires that it not be truncated
     SinkFileAdapter (const std::string &path)
-        : path(path)
-    {
-        outputStream.attach(path);
-    }
+        : path(path) {}
     
     virtual ~SinkFileAdapter () {}
     
     // Read header (if there is one) and prepare to read first streamline
     // Should return the current number of streamlines in the file (0 unless appending)
-    virtual size_t open (const bool append) { return 0; }
+    virtual size_t open (const bool append)
+    {
+        outputStream.attach(path, append);
+        return 0;
+    }
+    
+    // The current write offset, a way to make sure that everything before it
+    // is on disk, and a way to return to an earlier one. When
+    // resuming an interrupted file this discards anything written after the
+    // offset, and the file must have been opened for appending
+    virtual size_t tell () { return outputStream->tellp(); }
+    virtual void flush () { outputStream.sync(); }
+    virtual void seek (const size_t offset)
+    {
+        outputStream->seekp(offset);
+        if (!outputStream->good())
+            throw std::runtime_error("Failed to seek to offset " + std::to_string(offset));
+    }
     
     // The maximum number of streamlines that the format can store (0 means no limit)
     virtual size_t capacity () const { return 0; }
@@ -3,10 +3,10 @@
 #include "BinaryStream.h"
 #include "Files.h"
 
-void StreamlineFileSource::readLabels (const std::string &path)
+// Read the header and dictionary of a label file, leaving the stream at the
+// first streamline record, and return the number of streamlines
+static int readLabelHeader (BinaryInputStream &inputStream, std::map<int,std::string> &dictionary)
 {
-    BinaryInputStream inputStream(path);
-    
     if (inputStream.readString(8) != "TRKLABEL")
         throw std::runtime_error("Track label file does not seem to have a valid magic number");
     
@@ -24,16 +24,29 @@ void StreamlineFileSource::readLabels (const std::string &path)
         dictionary[value] = inputStream.readString();
     }
     
+    return nStreamlines;
+}
+
+void StreamlineFileSource::readLabels (const std::string &path)
+{
+    BinaryInputStream inputStream(path);
+    const int nStreamlines = readLabelHeader(inputStream, dictionary);
+    
     offsets.clear();
     labels.clear();
+    offsets.reserve(nStreamlines);
+    labels.reserve(nStreamlines);
+    std::vector<int> currentLabels;
     for (int j=0; j<nStreamlines; j++)
     {
         offsets.push_back(inputStream.readValue<uint64_t,size_t>());
         const int currentCount = inputStream.readValue<int32_t>();
-        std::set<int> currentLabels;
-        for (int i=0; i<currentCount; i++)
-            currentLabels.insert(inputStream.readValue<int32_t>());
-        labels.push_back(currentLabels);
+        // A zero length would mean "fill the existing vector" to readVector()
+        if (currentCount > 0)
+            inputStream.readVector<int32_t>(currentLabels, currentCount);
+        else
+            currentLabels.clear();
+        labels.push_back(LabelSet(currentLabels.begin(), currentLabels.end()));
     }
     
     haveLabels = true;
@@ -65,6 +78,45 @@ void StreamlineFileSource::seek (const size_t n)
     currentStreamline = n;
 }
 
+void StreamlineFileSink::saveState (BinaryOutputStream &stream) const
+{
+    // Everything written so far must reach the file before its offset is
+    // recorded, or resuming could leave a gap in the streamline data
+    sink->flush();
+    stream.writeValue<uint64_t>(currentStreamline);
+    stream.writeValue<uint64_t>(sink->tell());
+    
+    stream.writeValue<uint64_t>(labels.size());
+    for (size_t i=0; i<labels.size(); i++)
+    {
+        stream.writeValue<uint64_t>(offsets[i]);
+        stream.writeValue<int32_t>(labels[i].size());
+        if (!labels[i].empty())
+            stream.writeVector<int32_t>(labels[i].values());
+    }
+}
+
+void StreamlineFileSink::restoreState (BinaryInputStream &stream)
+{
+    currentStreamline = stream.readValue<uint64_t,size_t>();
+    sink->seek(stream.readValue<uint64_t,size_t>());
+    
+    const size_t nLabelSets = stream.readValue<uint64_t,size_t>();
+    offsets.clear();
+    labels.clear();
+    std::vector<int> currentLabels;
+    for (size_t i=0; i<nLabelSets; i++)
+    {
+        offsets.push_back(stream.readValue<uint64_t,size_t>());
+        const int currentCount = stream.readValue<int32_t>();
+        if (currentCount > 0)
+            stream.readVector<int32_t>(currentLabels, currentCount);
+        else
+            currentLabels.clear();
+        labels.push_back(LabelSet(currentLabels.begin(), currentLabels.end()));
+    }
+}
+
 void StreamlineFileSink::writeLabels (const std::string &path)
 {
     if (!keepLabels || (labels.empty() && offsets.empty()))
@@ -103,9 +155,157 @@ void StreamlineFileSink::writeLabels (const std::string &path)
     for (size_t i=0; i<offsets.size(); i++)
     {
         outputStream.writeValue<uint64_t>(offsets[i]);
-        const std::set<int> &currentLabels = labels[i];
+        const LabelSet &currentLabels = labels[i];
         outputStream.writeValue<int32_t>(currentLabels.size());
-        for (auto it=currentLabels.cbegin(); it!=currentLabels.cend(); it++)
-            outputStream.writeValue<int32_t>(*it);
+        if (!currentLabels.empty())
+            outputStream.writeVector<int32_t>(currentLabels.values());
+    }
+}
+
+size_t concatenateStreamlineFiles (const std::vector<std::string> &fileStems, const std::string &outputStem)
+{
+    if (fileStems.empty())
+        throw std::runtime_error("No streamline files were specified");
+    if (std::find(fileStems.begin(), fileStems.end(), outputStem) != fileStems.end())
+        throw std::runtime_error("The output file cannot also be an input");
+    
+    // Check that the headers match apart from the streamline count, which
+    // means they all describe the same space and store the same properties,
+    // and find out which files have labels. Only the label dictionaries are
+    // read at this stage
+    std::vector<char> header(1000), otherHeader(1000);
+    std::vector<size_t> counts(fileStems.size()), dataSizes(fileStems.size());
+    std::vector<bool> hasLabels(fileStems.size());
+    std::map<int,std::string> dictionary, otherDictionary;
+    bool swapped = false;
+    size_t total = 0;
+    for (size_t i=0; i<fileStems.size(); i++)
+    {
+        std::vector<char> &currentHeader = (i == 0 ? header : otherHeader);
+        BinaryInputStream inputStream(fileStems[i] + ".trk");
+        inputStream->seekg(0, std::ios::end);
+        const std::streamoff fileSize = inputStream->tellg();
+        inputStream->seekg(0);
+        if (!inputStream->good() || fileSize < 1000)
+            throw std::runtime_error("File " + fileStems[i] + ".trk is missing or is not a valid TrackVis file");
+        inputStream.readVector<char>(currentHeader);
+        
+        if (i == 0)
+        {
+            int32_t headerSize;
+            std::copy(header.begin() + 996, header.end(), reinterpret_cast<char *>(&headerSize));
+            if (headerSize != 1000)
+            {
+                BinaryStream::swap(headerSize);
+                if (headerSize != 1000)
+                    throw std::runtime_error("Trackvis file does not declare the expected header size");
+                swapped = true;
+            }
+        }
+        else if (!std::equal(header.begin(), header.begin() + 988, otherHeader.begin()) || !std::equal(header.begin() + 992, header.end(), otherHeader.begin() + 992))
+            throw std::runtime_error("Header of file " + fileStems[i] + ".trk does not match the first file");
+        
+        inputStream.setEndianness(swapped ? "swapped" : "native");
+        inputStream->seekg(988);
+        counts[i] = inputStream.readValue<int32_t,size_t>();
+        dataSizes[i] = static_cast<size_t>(fileSize) - 1000;
+        total += counts[i];
+        
+        hasLabels[i] = std::ifstream(fileStems[i] + ".trkl").good();
+        if (hasLabels[i])
+        {
+            BinaryInputStream labelStream(fileStems[i] + ".trkl");
+            if (static_cast<size_t>(readLabelHeader(labelStream, otherDictionary)) != counts[i])
+                throw std::runtime_error("Label file " + fileStems[i] + ".trkl does not match its streamline file");
+            for (const std::pair<const int,std::string> &element : otherDictionary)
+            {
+                auto it = dictionary.find(element.first);
+                if (it == dictionary.end())
+                    dictionary.insert(element);
+                else if (it->second != element.second)
+                    throw std::runtime_error("Label " + std::to_string(element.first) + " has different names in different files");
+            }
+        }
+    }
+    
+    if (total > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+        throw std::runtime_error("Total streamline count will exceed the capacity of the output file format");
+    
+    // No label file is written for an empty file, so labels are only needed
+    // if some file has them, and then every nonempty file must
+    const bool keepLabels = (std::find(hasLabels.begin(), hasLabels.end(), true) != hasLabels.end());
+    for (size_t i=0; i<fileStems.size(); i++)
+    {
+        if (keepLabels && !hasLabels[i] && counts[i] > 0)
+            throw std::runtime_error("File " + fileStems[i] + ".trk has no label file, but others do");
+    }
+    
+    // Copy the header, with the new count, and then each file's streamline
+    // data in turn, in fixed-size chunks
+    {
+        BinaryOutputStream outputStream(outputStem + ".trk");
+        outputStream.setEndianness(swapped ? "swapped" : "native");
+        outputStream.writeVector<char>(header);
+        outputStream->seekp(988);
+        outputStream.writeValue<int32_t>(total);
+        outputStream->seekp(1000);
+        
+        const size_t bufferSize = 1 << 20;
+        std::vector<char> buffer(bufferSize);
+        for (size_t i=0; i<fileStems.size(); i++)
+        {
+            BinaryInputStream inputStream(fileStems[i] + ".trk");
+            inputStream->seekg(1000);
+            size_t remaining = dataSizes[i];
+            while (remaining > 0)
+            {
+                const size_t chunkSize = std::min(remaining, bufferSize);
+                inputStream.readVector<char>(buffer, chunkSize);
+                outputStream.writeVector<char>(buffer, chunkSize);
+                remaining -= chunkSize;
+            }
+        }
     }
+    
+    // Stream the label records, shifting each file's offsets by the amount
+    // of data before it in the output
+    if (keepLabels && total > 0)
+    {
+        BinaryOutputStream outputStream(outputStem + ".trkl");
+        outputStream.writeString("TRKLABEL", false);
+        outputStream.writeValue<int32_t>(1);
+        outputStream.writeValue<int32_t>(total);
+        outputStream.writeValue<int32_t>(dictionary.size());
+        outputStream.writeValues<int32_t>(0, 3);
+        for (const std::pair<const int,std::string> &element : dictionary)
+        {
+            outputStream.writeValue<int32_t>(element.first);
+            outputStream.writeString(element.second);
+        }
+        
+        size_t shift = 0;
+        std::vector<int> currentLabels;
+        for (size_t i=0; i<fileStems.size(); i++)
+        {
+            if (hasLabels[i])
+            {
+                BinaryInputStream inputStream(fileStems[i] + ".trkl");
+                readLabelHeader(inputStream, otherDictionary);
+                for (size_t j=0; j<counts[i]; j++)
+                {
+                    outputStream.writeValue<uint64_t>(inputStream.readValue<uint64_t,size_t>() + shift);
+                    const int currentCount = inputStream.readValue<int32_t>();
+                    outputStream.writeValue<int32_t>(currentCount);
+                    if (currentCount > 0)
+                    {
+                        inputStream.readVector<int32_t>(currentLabels, currentCount);
+                        outputStream.writeVector<int32_t>(currentLabels);
+                    }
+                }
+            }
+            shift += dataSizes[i];
+        }
+    }
+    
+    return total;
 }
@@ -5,6 +5,7 @@
 #include "FileAdapters.h"
 #include "Trackvis.h"
 #include "Mrtrix.h"
+#include "Checkpoint.h"
 
 class StreamlineFileSource : public DataSource<Streamline>
 {
@@ -14,7 +15,7 @@ protected:
     StreamlineFileMetadata *metadata = nullptr;
     
     bool haveLabels = false;
-    std::vector<std::set<int>> labels;
+    std::vector<LabelSet> labels;
     std::vector<size_t> offsets;
     std::map<int,std::string> dictionary;
     
@@ -53,7 +54,7 @@ public:
     }
     
     bool hasLabels () const { return haveLabels; }
-    const std::vector<std::set<int>> & labelList () const { return labels; }
+    const std::vector<LabelSet> & labelList () const { return labels; }
     
     bool hasImageSpace () const { return (metadata != nullptr && metadata->space != nullptr); }
     ImageSpace * imageSpace () const { return metadata == nullptr ? nullptr : metadata->space; }
@@ -77,7 +78,7 @@ public:
     void done () override { source->close(); }
 };
 
-class StreamlineFileSink : public DataSink<Streamline>
+class StreamlineFileSink : public DataSink<Streamline>, public Checkpointable
 {
 protected:
     size_t currentStreamline = 0;
@@ -86,7 +87,7 @@ protected:
     StreamlineFileMetadata *metadata = nullptr;
     
     bool keepLabels = false;
-    std::vector<std::set<int>> labels;
+    std::vector<LabelSet> labels;
     std::vector<size_t> offsets;
     std::map<int,std::string> dictionary;
     
@@ -144,6 +145,19 @@ public:
         if (keepLabels)
             writeLabels(fileStem + ".trkl");
     }
+    
+    // The saved state includes the label records not yet written out, and
+    // restoring it requires the file to have been opened for appending
+    std::string stateTag () const override { return "file"; }
+    void saveState (BinaryOutputStream &stream) const override;
+    void restoreState (BinaryInputStream &stream) override;
 };
 
+// Concatenate TrackVis files and their label files, in the order given, into
+// a single output, as if the streamlines had been written by one sink. The
+// headers must match apart from the count. Streamline data are copied in
+// chunks without being parsed, and label records one at a time, so memory
+// use doesn't depend on the size of the files. Returns the total count
+size_t concatenateStreamlineFiles (const std::vector<std::string> &fileStems, const std::string &outputStem);
+
 #endif
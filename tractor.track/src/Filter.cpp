@@ -107,3 +107,149 @@ bool MedianStreamlineFilter::process (Streamline &data)
     data = Streamline(leftPoints, rightPoints, pointType, data.imageSpace(), false);
     return true;
 }
+
+P2QuantileEstimator::P2QuantileEstimator (const double probability)
+    : probability(probability)
+{
+    const double initialDesired[5] = { 1.0, 1.0 + 2.0*probability, 1.0 + 4.0*probability, 3.0 + 2.0*probability, 5.0 };
+    const double initialIncrements[5] = { 0.0, probability/2.0, probability, (1.0+probability)/2.0, 1.0 };
+    for (int i=0; i<5; i++)
+    {
+        heights[i] = 0.0;
+        positions[i] = static_cast<double>(i + 1);
+        desiredPositions[i] = initialDesired[i];
+        increments[i] = initialIncrements[i];
+    }
+}
+
+void P2QuantileEstimator::add (const double value)
+{
+    // The first five values are simply stored, and sorted once all are present
+    if (n < 5)
+    {
+        heights[n] = value;
+        n++;
+        if (n == 5)
+            std::sort(heights, heights + 5);
+        return;
+    }
+    
+    // Find the cell containing the new value, extending the extremes if needed
+    int cell;
+    if (value < heights[0])
+    {
+        heights[0] = value;
+        cell = 0;
+    }
+    else if (value >= heights[4])
+    {
+        heights[4] = value;
+        cell = 3;
+    }
+    else
+    {
+        cell = 0;
+        while (cell < 3 && value >= heights[cell+1])
+            cell++;
+    }
+    
+    for (int i=cell+1; i<5; i++)
+        positions[i] += 1.0;
+    for (int i=0; i<5; i++)
+        desiredPositions[i] += increments[i];
+    n++;
+    
+    // Adjust the heights of the middle markers if they are off position,
+    // using piecewise-parabolic interpolation if it is monotonic, or
+    // linear interpolation otherwise
+    for (int i=1; i<4; i++)
+    {
+        const double offset = desiredPositions[i] - positions[i];
+        if ((offset >= 1.0 && positions[i+1] - positions[i] > 1.0) || (offset <= -1.0 && positions[i-1] - positions[i] < -1.0))
+        {
+            const double sign = (offset >= 0.0 ? 1.0 : -1.0);
+            const double parabolic = heights[i] + sign / (positions[i+1] - positions[i-1]) * ((positions[i] - positions[i-1] + sign) * (heights[i+1] - heights[i]) / (positions[i+1] - positions[i]) + (positions[i+1] - positions[i] - sign) * (heights[i] - heights[i-1]) / (positions[i] - positions[i-1]));
+            if (heights[i-1] < parabolic && parabolic < heights[i+1])
+                heights[i] = parabolic;
+            else
+            {
+                const int j = i + static_cast<int>(sign);
+                heights[i] += sign * (heights[j] - heights[i]) / (positions[j] - positions[i]);
+            }
+            positions[i] += sign;
+        }
+    }
+}
+
+double P2QuantileEstimator::value () const
+{
+    if (n == 0)
+        return 0.0;
+    else if (n < 5)
+    {
+        // Not enough values for the markers yet, so calculate directly
+        std::vector<double> values(heights, heights + n);
+        const size_t index = static_cast<size_t>(floor((n-1) * probability));
+        return locateNthElement(values, index);
+    }
+    else
+        return heights[2];
+}
+
+void StreamingMedianStreamlineFilter::addPoints (const std::vector<ImageSpace::Point> &points, std::vector<PointEstimator> &estimators)
+{
+    if (estimators.size() < points.size())
+        estimators.resize(points.size());
+    
+    for (size_t j=0; j<points.size(); j++)
+    {
+        for (int k=0; k<3; k++)
+            estimators[j][k].add(points[j][k]);
+    }
+}
+
+std::vector<ImageSpace::Point> StreamingMedianStreamlineFilter::medianPoints (const std::vector<PointEstimator> &estimators, const size_t length) const
+{
+    std::vector<ImageSpace::Point> points(std::min(length, estimators.size()));
+    for (size_t j=0; j<points.size(); j++)
+    {
+        for (int k=0; k<3; k++)
+            points[j][k] = static_cast<ImageSpace::Element>(estimators[j][k].value());
+    }
+    return points;
+}
+
+// Like the exact filter, this rejects every streamline, but here the median is
+// emitted by flush() once the last one has been seen
+bool StreamingMedianStreamlineFilter::process (Streamline &data)
+{
+    if (count == 0)
+    {
+        pointType = data.getPointType();
+        space = data.imageSpace();
+    }
+    else if (data.getPointType() != pointType)
+        throw std::runtime_error("Point types do not match across streamlines, so median will make no sense");
+    
+    leftLength.add(static_cast<double>(data.getLeftPoints().size()));
+    rightLength.add(static_cast<double>(data.getRightPoints().size()));
+    addPoints(data.getLeftPoints(), leftEstimators);
+    addPoints(data.getRightPoints(), rightEstimators);
+    count++;
+    
+    return false;
+}
+
+bool StreamingMedianStreamlineFilter::flush (Streamline &data)
+{
+    if (count == 0)
+        return false;
+    
+    // Lengths are in steps here
+    const size_t leftSteps = static_cast<size_t>(std::round(leftLength.value()));
+    const size_t rightSteps = static_cast<size_t>(std::round(rightLength.value()));
+    
+    // Fixed spacing won't be preserved
+    data = Streamline(medianPoints(leftEstimators, leftSteps), medianPoints(rightEstimators, rightSteps), pointType, space, false);
+    return true;
+}
@@ -65,4 +65,46 @@ public:
     bool process (Streamline &data) override;
 };
 
+// Streaming quantile estimate using the P-squared algorithm (Jain & Chlamtac,
+// 1985), which needs only five markers however many values are added
+class P2QuantileEstimator
+{
+private:
+    double probability;
+    size_t n = 0;
+    double heights[5], positions[5], desiredPositions[5], increments[5];
+    
+public:
+    explicit P2QuantileEstimator (const double probability = 0.5);
+    
+    size_t count () const { return n; }
+    void add (const double value);
+    double value () const;
+};
+
+// An approximate version of MedianStreamlineFilter, which keeps quantile
+// estimates for each point index rather than caching every streamline, so
+// memory use is independent of the number of streamlines and blocks are fine
+class StreamingMedianStreamlineFilter : public DataManipulator<Streamline>
+{
+private:
+    typedef std::array<P2QuantileEstimator,3> PointEstimator;
+    
+    P2QuantileEstimator leftLength, rightLength;
+    std::vector<PointEstimator> leftEstimators, rightEstimators;
+    PointType pointType = PointType::Voxel;
+    ImageSpace *space = nullptr;
+    size_t count = 0;
+    
+    void addPoints (const std::vector<ImageSpace::Point> &points, std::vector<PointEstimator> &estimators);
+    std::vector<ImageSpace::Point> medianPoints (const std::vector<PointEstimator> &estimators, const size_t length) const;
+    
+public:
+    explicit StreamingMedianStreamlineFilter (const double quantile = 0.99)
+        : leftLength(quantile), rightLength(quantile) {}
+    
+    bool process (Streamline &data) override;
+    bool flush (Streamline &data) override;
+};
+
 #endif
@@ -2,28 +2,71 @@
 
 #include "Image.h"
 
-ImageSpace::Point ImageSpace::toVoxel (const Point &point, const PointType type, const RoundingType round) const
+// Applies the affine part of a 4x4 matrix to each point
+static void applyAffine (ImageSpace::Point * const points, const size_t n, const ImageSpace::Transform &matrix)
 {
-    Point result;
+    typedef ImageSpace::Element Element;
+    Element a[3][4];
+    for (int i=0; i<3; i++)
+    {
+        for (int j=0; j<4; j++)
+            a[i][j] = static_cast<Element>(matrix(i,j));
+    }
     
+    for (size_t k=0; k<n; k++)
+    {
+        const Element x = points[k][0], y = points[k][1], z = points[k][2];
+        for (int i=0; i<3; i++)
+            points[k][i] = a[i][0] * x + a[i][1] * y + a[i][2] * z + a[i][3];
+    }
+}
+
+const ImageSpace::Transform & ImageSpace::inverse () const
+{
+    bool current = haveInverse;
+    for (int i=0; i<4 && current; i++)
+    {
+        for (int j=0; j<4 && current; j++)
+            current = (inverseSource(i,j) == transform(i,j));
+    }
+    
+    if (!current)
+    {
+        inverseTransform = transform.inverse();
+        inverseSource = transform;
+        haveInverse = true;
+    }
+    return inverseTransform;
+}
+
+ImageSpace::Point ImageSpace::toVoxel (const Point &point, const PointType type, const RoundingType round) const
+{
+    Point result = point;
+    toVoxel(&result, 1, type, round);
+    return result;
+}
+
+void ImageSpace::toVoxel (Point * const points, const size_t n, const PointType type, const RoundingType round) const
+{
     switch (type)
     {
         case PointType::Voxel:
-        result = point;
         break;
         
         case PointType::Scaled:
-        for (int i=0; i<3; i++)
-            result[i] = point[i] / fabs(pixdim[i]);
-        break;
+        {
+            const Element scales[3] = { static_cast<Element>(fabs(pixdim[0])), static_cast<Element>(fabs(pixdim[1])), static_cast<Element>(fabs(pixdim[2])) };
+            for (size_t k=0; k<n; k++)
+            {
+                for (int i=0; i<3; i++)
+                    points[k][i] /= scales[i];
+            }
+            break;
+        }
         
+        // The xform maps voxels to world coordinates, so we need its inverse
         case PointType::World:
-        RNifti::NiftiImage::Xform::Vector4 padded(1.0);
-        for (int i=0; i<3; i++)
-            padded[i] = point[i];
-        const RNifti::NiftiImage::Xform::Vector4 product = transform.multiply(padded);
-        for (int i=0; i<3; i++)
-            result[i] = product[i];
+        applyAffine(points, n, inverse());
         break;
     }
     
@@ -33,24 +76,53 @@ ImageSpace::Point ImageSpace::toVoxel (const Point &point, const PointType type,
         break;
         
         case RoundingType::Conventional:
-        for (int i=0; i<3; i++)
-            result[i] = std::round(result[i]);
+        for (size_t k=0; k<n; k++)
+        {
+            for (int i=0; i<3; i++)
+                points[k][i] = std::round(points[k][i]);
+        }
         break;
         
+        // This uses R's RNG, so it is necessarily sequential
         case RoundingType::Probabilistic:
-        for (int i=0; i<3; i++)
+        for (size_t k=0; k<n; k++)
         {
-            const Element ceiling = std::ceil(result[i]);
-            const Element floor = std::floor(result[i]);
-            const Element distance = result[i] - floor;
-            
-            // Sample in proportion to proximity, unless we're off the end of the image
-            const Element uniformSample = static_cast<Element>(R::unif_rand());
-            const bool chooseFloor = (uniformSample > distance && floor >= 0.0) || ceiling >= static_cast<Element>(dim[i]);
-            result[i] = chooseFloor ? floor : ceiling;
+            for (int i=0; i<3; i++)
+            {
+                const Element ceiling = std::ceil(points[k][i]);
+                const Element floor = std::floor(points[k][i]);
+                const Element distance = points[k][i] - floor;
+                
+                // Sample in proportion to proximity, unless we're off the end of the image
+                const Element uniformSample = static_cast<Element>(R::unif_rand());
+                const bool chooseFloor = (uniformSample > distance && floor >= 0.0) || ceiling >= static_cast<Element>(dim[i]);
+                points[k][i] = chooseFloor ? floor : ceiling;
+            }
         }
         break;
     }
-    
-    return result;
+}
+
+void ImageSpace::fromVoxel (Point * const points, const size_t n, const PointType type) const
+{
+    switch (type)
+    {
+        case PointType::Voxel:
+        break;
+        
+        case PointType::Scaled:
+        {
+            const Element scales[3] = { static_cast<Element>(fabs(pixdim[0])), static_cast<Element>(fabs(pixdim[1])), static_cast<Element>(fabs(pixdim[2])) };
+            for (size_t k=0; k<n; k++)
+            {
+                for (int i=0; i<3; i++)
+                    points[k][i] *= scales[i];
+            }
+            break;
+        }
+        
+        case PointType::World:
+        applyAffine(points, n, transform);
+        break;
+    }
 }
@@ -68,9 +68,16 @@ enum struct RoundingType { None, Conventional, Probabilistic };
 class ImageSpace
 {
 public:
-    typedef RNifti::NiftiImage::Xform::Element Element;
-    typedef RNifti::NiftiImage::Xform::Vector3 Point;
-    typedef RNifti::NiftiImage::Xform::Vector3 Vector;
+    // Points and vectors are kept in single precision whatever the precision
+    // of RNifti's xforms, since streamline file formats only store 32-bit
+    // coordinates; define TRACTOR_DOUBLE_POINTS to use double precision
+#ifdef TRACTOR_DOUBLE_POINTS
+    typedef double Element;
+#else
+    typedef float Element;
+#endif
+    typedef RNifti::Vector<Element,3> Point;
+    typedef RNifti::Vector<Element,3> Vector;
     typedef RNifti::NiftiImage::Xform::Matrix Transform;
     
     // RNifti-compatible dim and pixdim array types
@@ -81,6 +88,13 @@ public:
     PixdimVector pixdim;
     Transform transform;
     
+private:
+    // The inverse of the transform, and the transform it was calculated
+    // from, which is public and may be changed in place
+    mutable Transform inverseTransform, inverseSource;
+    mutable bool haveInverse = false;
+    
+public:
     static Vector zeroVector ()
     {
         return Vector(0.0);
@@ -151,7 +165,27 @@ public:
     
     std::string orientation () const { return RNifti::NiftiImage::Xform(transform).orientation(); }
     
+    // The inverse of the transform, which is only recalculated if the
+    // transform has changed since the last call
+    const Transform & inverse () const;
+    
     Point toVoxel (const Point &point, const PointType type, const RoundingType round = RoundingType::Conventional) const;
+    
+    // Batch conversions, in place, over a contiguous array of points. The
+    // setup (scale factors or inverse xform) is done once per call, and the
+    // inner loops are branch-free so that they can be vectorised
+    void toVoxel (Point * const points, const size_t n, const PointType type, const RoundingType round = RoundingType::Conventional) const;
+    void fromVoxel (Point * const points, const size_t n, const PointType type) const;
+    
+    void toVoxel (std::vector<Point> &points, const PointType type, const RoundingType round = RoundingType::Conventional) const
+    {
+        toVoxel(points.data(), points.size(), type, round);
+    }
+    
+    void fromVoxel (std::vector<Point> &points, const PointType type) const
+    {
+        fromVoxel(points.data(), points.size(), type);
+    }
 };
 
 // Functionality for objects that conceptually exist within an image space
@@ -201,9 +235,156 @@ struct Indexer<D,1>
     size_t flatten (const std::array<size_t,D> &loc, const std::array<size_t,D> &strides) const { return loc[0]; }
 };
 
-// Handles image array functionality that does not depend on the datatype,
-// notably indexing
+// Layout policies map an array index onto an offset into an image's data
+// vector. Each provides setup(), which is given the dimensions and linear
+// strides of the array and returns the length of storage needed, and
+// offset(). The linear layout is the conventional one, with the first index
+// moving fastest (as in R and NIfTI)
+template <int Dimensionality>
+class LinearLayout
+{
+protected:
+    Indexer<Dimensionality> indexer;
+    
+public:
+    static const bool linear = true;
+    
+    size_t setup (const std::array<size_t,Dimensionality> &dims, const std::array<size_t,Dimensionality> &strides)
+    {
+        return strides[Dimensionality-1] * dims[Dimensionality-1];
+    }
+    
+    size_t offset (const std::array<size_t,Dimensionality> &loc, const std::array<size_t,Dimensionality> &strides) const
+    {
+        return indexer.flatten(loc, strides);
+    }
+};
+
+// Base class for layouts where the offset is a sum of per-axis terms over the
+// first three (spatial) dimensions, looked up from small tables. Any further
+// dimensions are stored innermost, so that (for example) all the samples for
+// a voxel are contiguous. Subclasses fill the tables in setupTables()
 template <int Dimensionality>
+class SeparableLayout
+{
+protected:
+    static const int spatialDims = (Dimensionality < 3 ? Dimensionality : 3);
+    
+    std::array<std::vector<size_t>,spatialDims> tables;
+    std::array<size_t,Dimensionality> innerStrides;
+    size_t innerSize = 1;
+    
+    // Should fill the tables with offsets in units of whole inner blocks, and
+    // return the number of such blocks needed
+    virtual size_t setupTables (const std::array<size_t,Dimensionality> &dims) = 0;
+    
+public:
+    static const bool linear = false;
+    
+    virtual ~SeparableLayout () {}
+    
+    size_t setup (const std::array<size_t,Dimensionality> &dims, const std::array<size_t,Dimensionality> &strides)
+    {
+        innerSize = 1;
+        innerStrides.fill(0);
+        for (int i=spatialDims; i<Dimensionality; i++)
+        {
+            innerStrides[i] = innerSize;
+            innerSize *= dims[i];
+        }
+        
+        const size_t blocks = setupTables(dims);
+        for (int i=0; i<spatialDims; i++)
+        {
+            for (size_t j=0; j<tables[i].size(); j++)
+                tables[i][j] *= innerSize;
+        }
+        return blocks * innerSize;
+    }
+    
+    size_t offset (const std::array<size_t,Dimensionality> &loc, const std::array<size_t,Dimensionality> &strides) const
+    {
+        size_t result = 0;
+        for (int i=0; i<spatialDims; i++)
+            result += tables[i][loc[i]];
+        for (int i=spatialDims; i<Dimensionality; i++)
+            result += innerStrides[i] * loc[i];
+        return result;
+    }
+};
+
+// Spatial dimensions are divided into cubic bricks of side BrickSize, each of
+// which is stored contiguously, so that small steps in any direction usually
+// stay within a few cache lines. Edge bricks are padded
+template <int Dimensionality, int BrickSize>
+class BrickedLayout : public SeparableLayout<Dimensionality>
+{
+protected:
+    size_t setupTables (const std::array<size_t,Dimensionality> &dims) override
+    {
+        size_t brickVolume = 1, withinStride = 1, brickStride;
+        for (int i=0; i<this->spatialDims; i++)
+            brickVolume *= BrickSize;
+        brickStride = brickVolume;
+        
+        for (int i=0; i<this->spatialDims; i++)
+        {
+            const size_t nBricks = (dims[i] + BrickSize - 1) / BrickSize;
+            this->tables[i].resize(dims[i]);
+            for (size_t j=0; j<dims[i]; j++)
+                this->tables[i][j] = (j / BrickSize) * brickStride + (j % BrickSize) * withinStride;
+            brickStride *= nBricks;
+            withinStride *= BrickSize;
+        }
+        return brickStride;
+    }
+};
+
+template <int Dimensionality> using Bricked4Layout = BrickedLayout<Dimensionality,4>;
+template <int Dimensionality> using Bricked8Layout = BrickedLayout<Dimensionality,8>;
+
+// Spatial indices are interleaved bitwise (Z-order), with each dimension
+// padded to a power of two; once the bits of a shorter dimension run out,
+// the remaining dimensions continue to be interleaved
+template <int Dimensionality>
+class MortonLayout : public SeparableLayout<Dimensionality>
+{
+protected:
+    size_t setupTables (const std::array<size_t,Dimensionality> &dims) override
+    {
+        int bits[3] = { 0, 0, 0 }, maxBits = 0;
+        for (int i=0; i<this->spatialDims; i++)
+        {
+            while ((size_t(1) << bits[i]) < dims[i])
+                bits[i]++;
+            maxBits = std::max(maxBits, bits[i]);
+            this->tables[i].assign(dims[i], 0);
+        }
+        
+        int position = 0;
+        for (int b=0; b<maxBits; b++)
+        {
+            for (int i=0; i<this->spatialDims; i++)
+            {
+                if (b >= bits[i])
+                    continue;
+                for (size_t j=0; j<dims[i]; j++)
+                {
+                    if (j & (size_t(1) << b))
+                        this->tables[i][j] |= size_t(1) << position;
+                }
+                position++;
+            }
+        }
+        return size_t(1) << position;
+    }
+};
+
+// Handles image array functionality that does not depend on the datatype,
+// notably indexing. Sizes and linear indices always refer to the
+// conventional ordering, but flattenIndex() gives an offset into storage
+// arranged according to the layout
+template <int Dimensionality, template <int> class Layout = LinearLayout>
 class ImageRaster
 {
 public:
@@ -211,7 +392,7 @@ public:
     
 protected:
     ArrayIndex dims, strides;
-    size_t length;
+    size_t length, storageLength;
     
     void calculateStrides ()
     {
@@ -223,12 +404,13 @@ protected:
             length *= dims[i-1];
         }
         length *= dims[Dimensionality - 1];
+        storageLength = layout.setup(dims, strides);
     }
     
-    Indexer<Dimensionality> indexer;
+    Layout<Dimensionality> layout;
     
 public:
-    ImageRaster () : length(0) { dims.fill(0); strides.fill(0); }
+    ImageRaster () : length(0), storageLength(0) { dims.fill(0); strides.fill(0); }
     
     // These constructors are not explicit because we want to allow automatic conversion
     ImageRaster (const ArrayIndex &dims)
@@ -253,28 +435,52 @@ public:
         calculateStrides();
     }
     
+    static bool linear () { return Layout<Dimensionality>::linear; }
+    
     const ArrayIndex & dim () const { return dims; }
     const size_t size () const { return length; }
+    const size_t storageSize () const { return storageLength; }
+    
+    size_t flattenIndex (const ArrayIndex &loc) const { return layout.offset(loc, strides); }
+    void flattenIndex (const ArrayIndex &loc, size_t &result) const { result = layout.offset(loc, strides); }
     
-    size_t flattenIndex (const ArrayIndex &loc) const { return indexer.flatten(loc, strides); }
-    void flattenIndex (const ArrayIndex &loc, size_t &result) const { result = indexer.flatten(loc, strides); }
+    // Storage offset corresponding to an index in conventional order
+    size_t storageIndex (size_t n) const
+    {
+        if (linear())
+            return n;
+        
+        ArrayIndex loc;
+        for (int i=0; i<Dimensionality; i++)
+        {
+            loc[i] = n % dims[i];
+            n /= dims[i];
+        }
+        return layout.offset(loc, strides);
+    }
 };
 
 namespace internal {
 
-template <class TargetType, int Dimensionality>
-inline void importNifti (const RNifti::NiftiImage &source, std::vector<TargetType> &target, ImageRaster<Dimensionality> &raster)
+template <class TargetType, int Dimensionality, template <int> class Layout>
+inline void importNifti (const RNifti::NiftiImage &source, std::vector<TargetType> &target, ImageRaster<Dimensionality,Layout> &raster)
 {
-    raster = ImageRaster<Dimensionality>(source.dim());
-    target.resize(raster.size());
+    raster = ImageRaster<Dimensionality,Layout>(source.dim());
+    target.resize(raster.storageSize());
     
     const RNifti::NiftiImageData sourceData = source.data();
-    std::copy(sourceData.begin(), sourceData.end(), target.begin());
+    if (raster.linear())
+        std::copy(sourceData.begin(), sourceData.end(), target.begin());
+    else
+    {
+        for (size_t i=0; i<raster.size(); i++)
+            target[raster.storageIndex(i)] = sourceData[i];
+    }
 };
 
 // Partial specialisation for vector-valued images
-template <int Dimensionality>
-inline void importNifti (const RNifti::NiftiImage &source, std::vector<ImageSpace::Vector> &target, ImageRaster<Dimensionality> &raster)
+template <int Dimensionality, template <int> class Layout>
+inline void importNifti (const RNifti::NiftiImage &source, std::vector<ImageSpace::Vector> &target, ImageRaster<Dimensionality,Layout> &raster)
 {
     // Which dimension indexes over the elements of the vectors?
     // NB: this is one-based because source->dim[0] is the dimensionality
@@ -296,30 +502,33 @@ inline void importNifti (const RNifti::NiftiImage &source, std::vector<ImageSpac
         dims.pop_back();
     
     // This construction checks that the remaining dims have the right length
-    raster = ImageRaster<Dimensionality>(dims);
-    target.resize(raster.size());
+    raster = ImageRaster<Dimensionality,Layout>(dims);
+    target.resize(raster.storageSize());
     
     const RNifti::NiftiImageData sourceData = source.data();
     const size_t volumeSize = source->nx * source->ny * source->nz;
     for (size_t i=0; i<volumeSize; i++)
     {
         ImageSpace::Element elements[3] { sourceData[i], sourceData[i+volumeSize], sourceData[i+2*volumeSize] };
-        target[i] = ImageSpace::Vector(elements);
+        target[raster.storageIndex(i)] = ImageSpace::Vector(elements);
     }
 }
 
 } // internal namespace
 
 // A typed and fixed-dimensionality bounded array embedded in 3D space
-// This class focusses on handling the pixel/voxel data
-template <class ElementType, int Dimensionality>
+// This class focusses on handling the pixel/voxel data. With a nonlinear
+// layout, flat indices (including those from the raster's flattenIndex(), and
+// iterators) refer to storage order, which may include padding, while data
+// passed in or out of the class is always in conventional order
+template <class ElementType, int Dimensionality, template <int> class Layout = LinearLayout>
 class Image : public ImageSpaceEmbedded
 {
 public:
     typedef ElementType Element;
     typedef std::vector<Element> Vector;
-    typedef ImageRaster<Dimensionality> Raster;
-    typedef typename ImageRaster<Dimensionality>::ArrayIndex ArrayIndex;
+    typedef ImageRaster<Dimensionality,Layout> Raster;
+    typedef typename Raster::ArrayIndex ArrayIndex;
     
 protected:
     Raster raster;
@@ -328,15 +537,21 @@ protected:
 public:
     // First argument may implicitly be anything that can initialise a Raster
     explicit Image (const Raster &raster, const Element value = Element())
-        : raster(raster), data_(raster.size(),value) {}
+        : raster(raster), data_(raster.storageSize(),value) {}
     
     explicit Image (const Raster &raster, const std::vector<Element> &data)
         : raster(raster)
     {
-        if (raster.size() == data.size())
+        if (raster.size() != data.size())
+            throw std::runtime_error("Data size does not match the specified dimensions");
+        else if (raster.linear())
             this->data_ = data;
         else
-            throw std::runtime_error("Data size does not match the specified dimensions");
+        {
+            this->data_.resize(raster.storageSize());
+            for (size_t i=0; i<data.size(); i++)
+                this->data_[raster.storageIndex(i)] = data[i];
+        }
     }
     
     explicit Image (const RNifti::NiftiImage &source)
@@ -357,7 +572,7 @@ public:
     
     operator SEXP () const
     {
-        Rcpp::RObject object = Rcpp::wrap(data_);
+        Rcpp::RObject object = Rcpp::wrap(linearData());
         object.attr("dim") = raster.dim();
         return object;
     }
@@ -369,6 +584,60 @@ public:
     const Vector & data () const { return data_; }
     void fill (const Element &value) { data_.assign(data_.size(), value); }
     
+    // The data in conventional order, whatever the layout
+    Vector linearData () const
+    {
+        if (raster.linear())
+            return data_;
+        
+        Vector result(raster.size());
+        for (size_t i=0; i<result.size(); i++)
+            result[i] = data_[raster.storageIndex(i)];
+        return result;
+    }
+    
+    // A copy of the block of voxels starting at the specified spatial
+    // location, with any further dimensions kept whole. The image space, if
+    // any, is adjusted so that world coordinates are unchanged. The caller
+    // takes ownership of the new image
+    Image * crop (const ImageSpace::DimVector &origin, const ImageSpace::DimVector &extent) const
+    {
+        ArrayIndex dims = raster.dim();
+        for (int i=0; i<std::min(3,Dimensionality); i++)
+        {
+            if (origin[i] < 0 || extent[i] < 1 || static_cast<size_t>(origin[i] + extent[i]) > dims[i])
+                throw std::runtime_error("Crop region does not fit within the image");
+            dims[i] = extent[i];
+        }
+        
+        Image *result = new Image(dims);
+        ArrayIndex loc, sourceLoc;
+        for (size_t n=0; n<result->size(); n++)
+        {
+            size_t remainder = n;
+            for (int i=0; i<Dimensionality; i++)
+            {
+                loc[i] = remainder % dims[i];
+                remainder /= dims[i];
+                sourceLoc[i] = loc[i] + (i < 3 ? origin[i] : 0);
+            }
+            (*result)[loc] = (*this)[sourceLoc];
+        }
+        
+        if (this->hasImageSpace())
+        {
+            ImageSpace *croppedSpace = new ImageSpace(*space);
+            for (int i=0; i<3; i++)
+            {
+                croppedSpace->dim[i] = extent[i];
+                for (int j=0; j<3; j++)
+                    croppedSpace->transform(i,3) += space->transform(i,j) * origin[j];
+            }
+            result->setImageSpace(croppedSpace);
+        }
+        return result;
+    }
+    
     RNifti::NiftiImage toNifti (const int datatype) const
     {
         std::vector<RNifti::NiftiImage::dim_t> dim(raster.dim().begin(), raster.dim().end());
@@ -380,7 +649,13 @@ public:
             object.qform() = space->transform;
             object->qform_code = 2;
         }
-        std::copy(data_.begin(), data_.end(), object.data().begin());
+        if (raster.linear())
+            std::copy(data_.begin(), data_.end(), object.data().begin());
+        else
+        {
+            const Vector linear = linearData();
+            std::copy(linear.begin(), linear.end(), object.data().begin());
+        }
         return object;
     }
     
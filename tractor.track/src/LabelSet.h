@@ -0,0 +1,133 @@
+#ifndef _LABEL_SET_H_
+#define _LABEL_SET_H_
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+
+// A set of integer labels, stored as a sorted vector rather than a tree. This
+// needs one allocation per set rather than one per label, and membership tests
+// and iteration are contiguous scans. Streamlines usually carry only a handful
+// of labels, so the cost of insertion into the middle is small
+class LabelSet
+{
+private:
+    std::vector<int> labels;
+    
+public:
+    typedef std::vector<int>::const_iterator const_iterator;
+    
+    LabelSet () {}
+    
+    template <class InputIterator>
+    LabelSet (InputIterator first, InputIterator last)
+        : labels(first, last)
+    {
+        if (!std::is_sorted(labels.begin(), labels.end()))
+            std::sort(labels.begin(), labels.end());
+        labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+    }
+    
+    bool insert (const int label)
+    {
+        auto it = std::lower_bound(labels.begin(), labels.end(), label);
+        if (it != labels.end() && *it == label)
+            return false;
+        labels.insert(it, label);
+        return true;
+    }
+    
+    size_t erase (const int label)
+    {
+        auto it = std::lower_bound(labels.begin(), labels.end(), label);
+        if (it == labels.end() || *it != label)
+            return 0;
+        labels.erase(it);
+        return 1;
+    }
+    
+    size_t count (const int label) const { return std::binary_search(labels.begin(), labels.end(), label) ? 1 : 0; }
+    size_t size () const { return labels.size(); }
+    bool empty () const { return labels.empty(); }
+    void clear () { labels.clear(); }
+    
+    const std::vector<int> & values () const { return labels; }
+    
+    const_iterator begin () const   { return labels.cbegin(); }
+    const_iterator end () const     { return labels.cend(); }
+    const_iterator cbegin () const  { return labels.cbegin(); }
+    const_iterator cend () const    { return labels.cend(); }
+    
+    bool operator== (const LabelSet &other) const { return labels == other.labels; }
+    bool operator!= (const LabelSet &other) const { return labels != other.labels; }
+};
+
+// Accumulates labels in a fixed bitmap, making insertion constant-time for
+// the small label values used by most parcellations. Any larger (or negative)
+// labels are kept in a LabelSet instead
+class LabelBitmap
+{
+private:
+    static const int nWords = 16;
+    std::array<uint64_t,nWords> words;
+    LabelSet overflow;
+    
+public:
+    static const int capacity = 64 * nWords;
+    
+    LabelBitmap () { words.fill(0); }
+    
+    bool insert (const int label)
+    {
+        if (label >= 0 && label < capacity)
+        {
+            const uint64_t mask = uint64_t(1) << (label % 64);
+            uint64_t &word = words[label / 64];
+            if (word & mask)
+                return false;
+            word |= mask;
+            return true;
+        }
+        else
+            return overflow.insert(label);
+    }
+    
+    size_t count (const int label) const
+    {
+        if (label >= 0 && label < capacity)
+            return (words[label / 64] >> (label % 64)) & 1;
+        else
+            return overflow.count(label);
+    }
+    
+    void clear ()
+    {
+        words.fill(0);
+        overflow.clear();
+    }
+    
+    // Negative labels sort before the bitmap and large ones after it, so the
+    // result can be built in order without sorting
+    LabelSet toLabelSet () const
+    {
+        std::vector<int> labels;
+        auto it = overflow.begin();
+        for (; it != overflow.end() && *it < 0; it++)
+            labels.push_back(*it);
+        for (int i=0; i<nWords; i++)
+        {
+            uint64_t word = words[i];
+            for (int j=0; word != 0; j++, word >>= 1)
+            {
+                if (word & 1)
+                    labels.push_back(64 * i + j);
+            }
+        }
+        for (; it != overflow.end(); it++)
+            labels.push_back(*it);
+        return LabelSet(labels.begin(), labels.end());
+    }
+};
+
+#endif
@@ -3,12 +3,69 @@
 #include "Streamline.h"
 #include "Pipeline.h"
 
+template <class ElementType>
+size_t Pipeline<ElementType>::processBlock (const bool finalBlock, const bool feedback)
+{
+    // Apply the manipulator(s), if there are any
+    for (int i=0; i<manipulators.size(); i++)
+    {
+        manipulators[i]->setup(workingSet.size());
+        auto it = workingSet.begin();
+        while (it != workingSet.end())
+        {
+            bool keep = manipulators[i]->process(*it);
+            if (keep)
+                it++;
+            else
+                it = workingSet.erase(it);
+        }
+        
+        // Give streaming manipulators the chance to emit a final element
+        if (finalBlock)
+        {
+            ElementType element;
+            if (manipulators[i]->flush(element))
+                workingSet.push_back(element);
+        }
+    }
+    
+    // Tell the source how many elements survived, and drop any it doesn't want
+    if (feedback)
+    {
+        const size_t kept = source->accept(workingSet.size());
+        if (kept < workingSet.size())
+            workingSet.resize(kept);
+    }
+    
+    // If the manipulators have thrown out everything, there's nothing left to do
+    if (workingSet.empty())
+        return 0;
+    
+    // Pass the remaining data to the sink(s)
+    for (int i=0; i<sinks.size(); i++)
+    {
+        // Tell the sink how many elements are incoming
+        sinks[i]->setup(workingSet.size());
+        
+        // Pass each element to the sink
+        for (auto it=workingSet.cbegin(); it!=workingSet.cend(); it++)
+            sinks[i]->put(*it);
+        
+        sinks[i]->finish();
+    }
+    
+    // Empty the working set again
+    const size_t count = workingSet.size();
+    workingSet.clear();
+    return count;
+}
+
 template <class ElementType>
 size_t Pipeline<ElementType>::run ()
 {
     size_t total = 0, subsetIndex = 0;
     const bool usingSubset = (subset.size() > 0);
-    bool subsetFinished = false;
+    bool subsetFinished = false, flushed = false;
     
     // If there's no data source there's nothing to do
     if (source == nullptr)
@@ -18,6 +75,9 @@ size_t Pipeline<ElementType>::run ()
     source->setup();
     workingSet.clear();
     
+    // The source may ask for smaller blocks, e.g. when close to a quota
+    size_t currentBlockSize = source->preferredBlockSize(blockSize), retrieved = 0;
+    
     while (source->more() && !subsetFinished)
     {
         Rcpp::checkUserInterrupt();
@@ -34,60 +94,33 @@ size_t Pipeline<ElementType>::run ()
             subsetIndex++;
         }
         
-        // Get the next element and insert it into the working set
+        // Get the next element and insert it into the working set, unless the source rejects it
         // If the subset is finished we don't want any more elements, so skip this
         if (!subsetFinished)
         {
             ElementType element;
             source->get(element);
-            workingSet.push_back(element);
+            if (!source->discard())
+                workingSet.push_back(element);
+            retrieved++;
         }
         
-        // Process the data when the working set is full or there's nothing more incoming
-        if (workingSet.size() == blockSize || !source->more() || subsetFinished)
+        // Process the data when the block is complete or there's nothing more incoming
+        if (retrieved >= currentBlockSize || !source->more() || subsetFinished)
         {
-            total += workingSet.size();
-            
-            // Apply the manipulator(s), if there are any
-            for (int i=0; i<manipulators.size(); i++)
-            {
-                manipulators[i]->setup(workingSet.size());
-                auto it = workingSet.begin();
-                while (it != workingSet.end())
-                {
-                    bool keep = manipulators[i]->process(*it);
-                    if (keep)
-                        it++;
-                    else
-                    {
-                        it = workingSet.erase(it);
-                        total--;
-                    }
-                }
-            }
+            flushed = (!source->more() || subsetFinished);
+            total += processBlock(flushed, true);
             
-            // If the manipulators have thrown out everything, there's nothing left to do
-            if (workingSet.empty())
-                continue;
-            
-            // Pass the remaining data to the sink(s)
-            for (int i=0; i<sinks.size(); i++)
-            {
-                // Tell the sink how many elements are incoming
-                sinks[i]->setup(workingSet.size());
-                
-                // Pass each element to the sink
-                for (auto it=workingSet.cbegin(); it!=workingSet.cend(); it++)
-                    sinks[i]->put(*it);
-                
-                sinks[i]->finish();
-            }
-            
-            // Empty the working set again
-            workingSet.clear();
+            retrieved = 0;
+            currentBlockSize = source->preferredBlockSize(blockSize);
         }
     }
     
+    // A source may only discover that it is finished once a block has been
+    // processed, in which case the manipulators have not yet been flushed
+    if (!flushed)
+        total += processBlock(true, false);
+    
     for (int i=0; i<sinks.size(); i++)
         sinks[i]->done();
     source->done();
@@ -19,6 +19,8 @@ private:
     std::vector<size_t> subset;
     std::list<ElementType> workingSet;
     
+    size_t processBlock (const bool finalBlock, const bool feedback);
+    
 public:
     explicit Pipeline (DataSource<ElementType> * const source, const size_t blockSize = 1000)
         : source(source), blockSize(blockSize) {}
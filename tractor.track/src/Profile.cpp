@@ -0,0 +1,153 @@
+#include <Rcpp.h>
+
+#include "Profile.h"
+
+ScalarProfileDataSink::ScalarProfileDataSink (const std::vector<Image<float,3> *> &images, const InterpolationType interpolation, const double binWidth, const double maxDistance)
+    : images(images), interpolation(interpolation), binWidth(binWidth)
+{
+    for (Image<float,3> *image : images)
+    {
+        if (!image->hasImageSpace())
+            throw std::runtime_error("Scalar images must have image space information");
+    }
+    if (binWidth <= 0.0)
+        throw std::runtime_error("Bin width must be positive");
+    
+    nBins = static_cast<int>(ceil(maxDistance / binWidth));
+    streamlineMeans.resize(images.size());
+    binSums.assign(images.size(), std::vector<double>(2 * nBins, 0.0));
+    binSquaredSums.assign(images.size(), std::vector<double>(2 * nBins, 0.0));
+    binCounts.assign(images.size(), std::vector<size_t>(2 * nBins, 0));
+}
+
+double ScalarProfileDataSink::sample (const Image<float,3> &image, const ImageSpace::Point &voxel, bool &valid) const
+{
+    const Image<float,3>::ArrayIndex &dims = image.dim();
+    valid = false;
+    for (int i=0; i<3; i++)
+    {
+        if (voxel[i] < -0.5 || voxel[i] > dims[i] - 0.5)
+            return 0.0;
+    }
+    
+    if (interpolation == InterpolationType::Nearest)
+    {
+        Image<float,3>::ArrayIndex loc;
+        for (int i=0; i<3; i++)
+            loc[i] = std::min(static_cast<size_t>(std::max(std::round(voxel[i]), ImageSpace::Element(0))), dims[i] - 1);
+        valid = true;
+        return static_cast<double>(image[loc]);
+    }
+    
+    // Trilinear interpolation, clamping to the edges of the image
+    size_t lower[3], upper[3];
+    double fractions[3];
+    for (int i=0; i<3; i++)
+    {
+        const double clamped = std::min(std::max(static_cast<double>(voxel[i]), 0.0), static_cast<double>(dims[i] - 1));
+        lower[i] = static_cast<size_t>(floor(clamped));
+        upper[i] = std::min(lower[i] + 1, dims[i] - 1);
+        fractions[i] = clamped - lower[i];
+    }
+    
+    double result = 0.0;
+    for (int corner=0; corner<8; corner++)
+    {
+        Image<float,3>::ArrayIndex loc;
+        double weight = 1.0;
+        for (int i=0; i<3; i++)
+        {
+            const bool high = (corner >> i) & 1;
+            loc[i] = high ? upper[i] : lower[i];
+            weight *= high ? fractions[i] : 1.0 - fractions[i];
+        }
+        if (weight > 0.0)
+            result += weight * static_cast<double>(image[loc]);
+    }
+    valid = true;
+    return result;
+}
+
+void ScalarProfileDataSink::put (const Streamline &data)
+{
+    if (!data.hasImageSpace())
+        throw std::runtime_error("Streamline has no image space information");
+    
+    points.clear();
+    data.visitPoints([this](const ImageSpace::Point &point) { points.push_back(point); });
+    
+    // Signed arc length of each point from the seed, in real-world units
+    voxels = points;
+    if (data.getPointType() == PointType::Voxel)
+        data.imageSpace()->fromVoxel(voxels, PointType::Scaled);
+    distances.assign(points.size(), 0.0);
+    for (size_t k=1; k<points.size(); k++)
+        distances[k] = distances[k-1] + static_cast<double>(ImageSpace::norm(ImageSpace::step(voxels[k-1], voxels[k])));
+    const size_t seedIndex = (data.getLeftPoints().empty() ? 0 : data.getLeftPoints().size() - 1);
+    const double seedDistance = (points.empty() ? 0.0 : distances[seedIndex]);
+    
+    for (size_t j=0; j<images.size(); j++)
+    {
+        const Image<float,3> &image = *images[j];
+        voxels = points;
+        image.imageSpace()->toVoxel(voxels, data.getPointType(), RoundingType::None);
+        
+        double sum = 0.0;
+        size_t count = 0;
+        for (size_t k=0; k<voxels.size(); k++)
+        {
+            bool valid;
+            const double value = sample(image, voxels[k], valid);
+            if (!valid || ISNAN(value))
+                continue;
+            
+            sum += value;
+            count++;
+            
+            const int bin = static_cast<int>(floor((distances[k] - seedDistance) / binWidth)) + nBins;
+            if (bin >= 0 && bin < 2 * nBins)
+            {
+                binSums[j][bin] += value;
+                binSquaredSums[j][bin] += value * value;
+                binCounts[j][bin]++;
+            }
+        }
+        
+        streamlineMeans[j].push_back(count > 0 ? sum / count : NA_REAL);
+    }
+}
+
+std::vector<double> ScalarProfileDataSink::getBinCentres () const
+{
+    std::vector<double> result(2 * nBins);
+    for (int b=0; b<2*nBins; b++)
+        result[b] = (b - nBins + 0.5) * binWidth;
+    return result;
+}
+
+std::vector<double> ScalarProfileDataSink::getBinMeans (const size_t image) const
+{
+    std::vector<double> result(2 * nBins, NA_REAL);
+    for (int b=0; b<2*nBins; b++)
+    {
+        if (binCounts[image][b] > 0)
+            result[b] = binSums[image][b] / binCounts[image][b];
+    }
+    return result;
+}
+
+std::vector<double> ScalarProfileDataSink::getBinStandardDeviations (const size_t image) const
+{
+    std::vector<double> result(2 * nBins, NA_REAL);
+    for (int b=0; b<2*nBins; b++)
+    {
+        const size_t n = binCounts[image][b];
+        if (n > 1)
+        {
+            const double mean = binSums[image][b] / n;
+            const double variance = (binSquaredSums[image][b] - n * mean * mean) / (n - 1);
+            result[b] = sqrt(std::max(variance, 0.0));
+        }
+    }
+    return result;
+}
@@ -0,0 +1,65 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include "DataSource.h"
+#include "Streamline.h"
+#include "Image.h"
+
+// Samples scalar images along streamlines, giving the mean of each image per
+// streamline and, across all streamlines, statistics within bins of signed
+// arc length from the seed point (negative on the left side). Only points
+// inside each image contribute to its statistics
+class ScalarProfileDataSink : public DataSink<Streamline>
+{
+public:
+    enum struct InterpolationType { Nearest, Trilinear };
+    
+private:
+    // The images are owned by this object
+    std::vector<Image<float,3> *> images;
+    InterpolationType interpolation;
+    double binWidth;
+    int nBins;
+    
+    // Per-streamline means, one vector per image
+    std::vector<std::vector<double>> streamlineMeans;
+    
+    // Per-bin running totals, indexed by image then bin
+    std::vector<std::vector<double>> binSums, binSquaredSums;
+    std::vector<std::vector<size_t>> binCounts;
+    
+    // Working storage
+    std::vector<ImageSpace::Point> points, voxels;
+    std::vector<double> distances;
+    
+    double sample (const Image<float,3> &image, const ImageSpace::Point &voxel, bool &valid) const;
+    
+public:
+    // Delete the default constructor
+    ScalarProfileDataSink () = delete;
+    
+    // Bins cover a distance of maxDistance either side of the seed; points
+    // further away only contribute to the per-streamline means
+    ScalarProfileDataSink (const std::vector<Image<float,3> *> &images, const InterpolationType interpolation, const double binWidth, const double maxDistance);
+    
+    ~ScalarProfileDataSink ()
+    {
+        for (Image<float,3> *image : images)
+            delete image;
+    }
+    
+    void put (const Streamline &data) override;
+    
+    size_t nImages () const { return images.size(); }
+    int binCount () const { return 2 * nBins; }
+    
+    // Signed distance of the centre of each bin from the seed
+    std::vector<double> getBinCentres () const;
+    
+    const std::vector<double> & getStreamlineMeans (const size_t image) const { return streamlineMeans[image]; }
+    const std::vector<size_t> & getBinCounts (const size_t image) const { return binCounts[image]; }
+    std::vector<double> getBinMeans (const size_t image) const;
+    std::vector<double> getBinStandardDeviations (const size_t image) const;
+};
+
+#endif
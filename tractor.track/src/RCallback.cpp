@@ -51,44 +51,150 @@ void RListDataSource::get (Streamline &data)
     currentStreamline++;
 }
 
-void RListDataSink::setup (const size_t &count)
+// Offsets must start at or after zero, never decrease, and stay within the
+// vector or matrix they index into
+static void checkOffsets (const Rcpp::IntegerVector &offsets, const int limit, const std::string &name)
 {
-    totalStreamlines += count;
-    List tempList = list;
-    list = List(totalStreamlines);
-    std::copy(tempList.begin(), tempList.end(), list.begin());
+    const int n = offsets.size();
+    if (n == 0 || offsets[0] < 0)
+        throw std::runtime_error(name + " vector should start with a nonnegative value");
+    for (int i=1; i<n; i++)
+    {
+        if (offsets[i] < offsets[i-1])
+            throw std::runtime_error(name + " vector should be nondecreasing");
+    }
+    if (offsets[n-1] > limit)
+        throw std::runtime_error(name + " vector points past the end of the data");
 }
 
-void RListDataSink::put (const Streamline &data)
+RColumnarDataSource::RColumnarDataSource (SEXP list)
 {
-    if (!data.hasImageSpace())
-        throw std::runtime_error("Streamline has no image space information");
+    List columns(list);
+    points = columns["points"];
+    offsets = columns["offsets"];
+    seeds = columns["seeds"];
+    
+    if (points.ncol() != 3)
+        throw std::runtime_error("Point matrix must have three columns");
+    if (offsets.size() != seeds.size() + 1)
+        throw std::runtime_error("Offset vector should be one element longer than the seed vector");
+    checkOffsets(offsets, points.nrow(), "Offset");
+    
+    if (!Rf_isNull(columns["labels"]) && !Rf_isNull(columns["labelOffsets"]))
+    {
+        labels = columns["labels"];
+        labelOffsets = columns["labelOffsets"];
+        if (labelOffsets.size() != offsets.size())
+            throw std::runtime_error("Label offset vector should be the same length as the offset vector");
+        checkOffsets(labelOffsets, labels.size(), "Label offset");
+        haveLabels = true;
+    }
     
-    const std::vector<ImageSpace::Point> points = data.getPoints();
+    pointType = as<std::string>(columns["coordUnit"]) == "vox" ? PointType::Voxel : PointType::Scaled;
+    totalStreamlines = static_cast<size_t>(seeds.size());
     
-    NumericMatrix pointsR(points.size(), 3);
-    const int seedIndexR = static_cast<int>(data.getSeedIndex()) + 1;
+    ImageSpace *space = new ImageSpace(as<ImageSpace::DimVector>(columns["spaceDims"]), as<ImageSpace::PixdimVector>(columns["voxelDims"]));
+    setImageSpace(space);
+}
+
+void RColumnarDataSource::get (Streamline &data)
+{
+    const int start = offsets[currentStreamline];
+    const int end = offsets[currentStreamline+1];
+    const int seed = start + seeds[currentStreamline] - 1;
+    if (seed < start || (seed >= end && end > start))
+        throw std::runtime_error("Seed index for streamline " + std::to_string(currentStreamline+1) + " is out of bounds");
     
-    const PointType pointType = data.getPointType();
+    // The matrix is column-major, so each coordinate is a contiguous block
+    const size_t nRows = static_cast<size_t>(points.nrow());
+    const double *x = points.begin();
+    const double *y = x + nRows;
+    const double *z = y + nRows;
+    const double adjustment = (pointType == PointType::Voxel ? 1.0 : 0.0);
     
-    for (size_t i=0; i<points.size(); i++)
+    ImageSpace::Point point;
+    std::vector<ImageSpace::Point> leftPoints, rightPoints;
+    if (end > start)
     {
-        pointsR(i,0) = points[i][0] + (pointType == PointType::Voxel ? 1.0 : 0.0);
-        pointsR(i,1) = points[i][1] + (pointType == PointType::Voxel ? 1.0 : 0.0);
-        pointsR(i,2) = points[i][2] + (pointType == PointType::Voxel ? 1.0 : 0.0);
+        leftPoints.reserve(seed - start + 1);
+        rightPoints.reserve(end - seed);
+        for (int i=seed; i>=start; i--)
+        {
+            point[0] = x[i] - adjustment;
+            point[1] = y[i] - adjustment;
+            point[2] = z[i] - adjustment;
+            leftPoints.push_back(point);
+        }
+        for (int i=seed; i<end; i++)
+        {
+            point[0] = x[i] - adjustment;
+            point[1] = y[i] - adjustment;
+            point[2] = z[i] - adjustment;
+            rightPoints.push_back(point);
+        }
     }
     
+    data = Streamline(leftPoints, rightPoints, pointType, space, false);
+    if (haveLabels)
+        data.setLabels(LabelSet(labels.begin() + labelOffsets[currentStreamline], labels.begin() + labelOffsets[currentStreamline+1]));
+    currentStreamline++;
+}
+
+void RColumnarDataSink::put (const Streamline &data)
+{
+    if (!data.hasImageSpace())
+        throw std::runtime_error("Streamline has no image space information");
+    
+    // The first streamline determines the space and point type
+    if (!haveSpace)
+    {
+        spaceDims = data.imageSpace()->dim;
+        voxelDims = data.imageSpace()->pixdim;
+        pointType = data.getPointType();
+        haveSpace = true;
+    }
+    else if (data.getPointType() != pointType)
+        throw std::runtime_error("Point types do not match across streamlines, so they cannot be exported together");
+    
+    const double offset = (pointType == PointType::Voxel ? 1.0 : 0.0);
+    data.visitPoints([this,offset](const ImageSpace::Point &point) {
+        for (int j=0; j<3; j++)
+            points[j].push_back(static_cast<double>(point[j]) + offset);
+    });
+    
+    if (points[0].size() > static_cast<size_t>(std::numeric_limits<int>::max()))
+        throw std::runtime_error("Total number of points is too large to export to R");
+    
+    offsets.push_back(static_cast<int>(points[0].size()));
+    seeds.push_back(data.getLeftPoints().size() > 0 ? static_cast<int>(data.getLeftPoints().size()) : 1);
+    
+    const LabelSet &currentLabels = data.getLabels();
+    labels.insert(labels.end(), currentLabels.cbegin(), currentLabels.cend());
+    labelOffsets.push_back(static_cast<int>(labels.size()));
+}
+
+Rcpp::List RColumnarDataSink::getList () const
+{
+    const size_t nPoints = points[0].size();
+    NumericMatrix pointsR(nPoints, 3);
+    for (int j=0; j<3; j++)
+        std::copy(points[j].begin(), points[j].end(), pointsR.begin() + j * nPoints);
+    
     // FIXME: Strictly, the R class expects PointType::Scaled or PointType::Voxel only
     const std::string unit = (pointType == PointType::Voxel ? "vox" : "mm");
     
-    Language call(constructor, _["line"]=pointsR, _["seedIndex"]=seedIndexR, _["spaceDims"]=data.imageSpace()->dim, _["voxelDims"]=data.imageSpace()->pixdim, _["coordUnit"]=unit);
-    list[currentStreamline] = call.eval();
-    currentStreamline++;
+    List result = List::create(_["points"]=pointsR, _["offsets"]=offsets, _["seeds"]=seeds, _["labels"]=labels, _["labelOffsets"]=labelOffsets, _["coordUnit"]=unit);
+    if (haveSpace)
+    {
+        result["spaceDims"] = spaceDims;
+        result["voxelDims"] = voxelDims;
+    }
+    return result;
 }
 
 void LabelProfileDataSink::put (const Streamline &data)
 {
-    const std::set<int> &labels = data.getLabels();
+    const LabelSet &labels = data.getLabels();
     for (auto it=labels.cbegin(); it!=labels.cend(); it++)
     {
         if (counts.count(*it) == 0)
@@ -118,3 +224,24 @@ void LabelProfileDataSink::done ()
     profile = labelCounts;
     profile.attr("names") = labels;
 }
+
+void LabelProfileDataSink::saveState (BinaryOutputStream &stream) const
+{
+    stream.writeValue<int32_t>(counts.size());
+    for (auto it=counts.cbegin(); it!=counts.cend(); it++)
+    {
+        stream.writeValue<int32_t>(it->first);
+        stream.writeValue<uint64_t>(it->second);
+    }
+}
+
+void LabelProfileDataSink::restoreState (BinaryInputStream &stream)
+{
+    counts.clear();
+    const int nLabels = stream.readValue<int32_t>();
+    for (int i=0; i<nLabels; i++)
+    {
+        const int label = stream.readValue<int32_t>();
+        counts[label] = stream.readValue<uint64_t,size_t>();
+    }
+}
@@ -3,6 +3,7 @@
 
 #include "DataSource.h"
 #include "Streamline.h"
+#include "Checkpoint.h"
 
 #include <Rcpp.h>
 
@@ -27,24 +28,56 @@ public:
     bool seekable () override { return true; }
 };
 
-class RListDataSink : public DataSink<Streamline>
+// Reads streamlines from the columnar representation produced by
+// RColumnarDataSink, working directly on the R vectors
+class RColumnarDataSource : public DataSource<Streamline>, public ImageSpaceEmbedded
 {
 private:
-    SEXP constructor;
-    Rcpp::List list;
+    Rcpp::NumericMatrix points;
+    Rcpp::IntegerVector offsets, seeds, labels, labelOffsets;
+    PointType pointType;
+    bool haveLabels = false;
     size_t currentStreamline = 0, totalStreamlines = 0;
+    
+public:
+    RColumnarDataSource (SEXP list);
+    
+    std::string type () const override { return "columnar"; }
+    
+    void setup () override { currentStreamline = 0; }
+    size_t count () override { return totalStreamlines; }
+    bool more () override { return currentStreamline < totalStreamlines; }
+    void get (Streamline &data) override;
+    void seek (const size_t n) override { currentStreamline = n; }
+    bool seekable () override { return true; }
+};
 
+// Exports streamlines to R in columnar form: a single matrix of points for all
+// streamlines, plus vectors of offsets into it, seed indices and labels. This
+// avoids creating an R object per streamline; those are created lazily in R
+class RColumnarDataSink : public DataSink<Streamline>
+{
+private:
+    std::vector<double> points[3];
+    std::vector<int> offsets, seeds, labels, labelOffsets;
+    ImageSpace::DimVector spaceDims;
+    ImageSpace::PixdimVector voxelDims;
+    bool haveSpace = false;
+    PointType pointType = PointType::Voxel;
+    
 public:
-    RListDataSink (SEXP constructor)
-        : constructor(constructor) {}
+    RColumnarDataSink ()
+    {
+        offsets.push_back(0);
+        labelOffsets.push_back(0);
+    }
     
-    void setup (const size_t &count) override;
     void put (const Streamline &data) override;
     
-    Rcpp::List getList () const { return list; }
+    Rcpp::List getList () const;
 };
 
-class LabelProfileDataSink : public DataSink<Streamline>
+class LabelProfileDataSink : public DataSink<Streamline>, public Checkpointable
 {
 private:
     std::map<int,size_t> counts;
@@ -57,6 +90,10 @@ public:
     void put (const Streamline &data) override;
     void done () override;
     
+    std::string stateTag () const override { return "profile"; }
+    void saveState (BinaryOutputStream &stream) const override;
+    void restoreState (BinaryInputStream &stream) override;
+    
     Rcpp::IntegerVector getProfile () const { return profile; }
 };
 
@@ -0,0 +1,90 @@
+#ifndef _ROUTING_H_
+#define _ROUTING_H_
+
+#include "DataSource.h"
+#include "Streamline.h"
+
+// Sends each streamline to a group of sinks chosen by the region label of the
+// seed it was generated from, so that several seed regions can be handled in a
+// single tracking run. The sinks are owned by this object
+class RoutingDataSink : public DataSink<Streamline>
+{
+private:
+    std::vector<int> seedLabels;
+    std::map<int,std::vector<DataSink<Streamline>*>> routes;
+    std::map<int,size_t> counts;
+    
+    // Streamlines from the current block, by label; the pipeline's working set
+    // is unchanged until finish() is called, so pointers to it are safe
+    std::map<int,std::vector<const Streamline *>> pending;
+    
+public:
+    // Delete the default constructor
+    RoutingDataSink () = delete;
+    
+    explicit RoutingDataSink (const std::vector<int> &seedLabels)
+        : seedLabels(seedLabels) {}
+    
+    ~RoutingDataSink ()
+    {
+        for (auto it=routes.begin(); it!=routes.end(); it++)
+        {
+            for (size_t i=0; i<it->second.size(); i++)
+                delete it->second[i];
+        }
+    }
+    
+    void addSink (const int label, DataSink<Streamline> * const sink)
+    {
+        if (sink != nullptr)
+        {
+            routes[label].push_back(sink);
+            counts[label] = 0;
+        }
+    }
+    
+    size_t count (const int label) const
+    {
+        auto it = counts.find(label);
+        return (it == counts.end() ? 0 : it->second);
+    }
+    
+    void put (const Streamline &data) override
+    {
+        const int seedId = data.getSeedId();
+        if (seedId < 0 || static_cast<size_t>(seedId) >= seedLabels.size())
+            throw std::runtime_error("Streamline has no valid seed index, so it cannot be routed");
+        
+        const int label = seedLabels[seedId];
+        if (routes.count(label) == 1)
+            pending[label].push_back(&data);
+    }
+    
+    void finish () override
+    {
+        for (auto it=pending.cbegin(); it!=pending.cend(); it++)
+        {
+            const std::vector<const Streamline *> &streamlines = it->second;
+            for (DataSink<Streamline> *sink : routes[it->first])
+            {
+                sink->setup(streamlines.size());
+                for (size_t i=0; i<streamlines.size(); i++)
+                    sink->put(*streamlines[i]);
+                sink->finish();
+            }
+            counts[it->first] += streamlines.size();
+        }
+        pending.clear();
+    }
+    
+    void done () override
+    {
+        for (auto it=routes.begin(); it!=routes.end(); it++)
+        {
+            for (DataSink<Streamline> *sink : it->second)
+                sink->done();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include <Rcpp.h>
+
+#include "Seeds.h"
+
+// Spread the low 21 bits of a value out so that there are two zero bits
+// between each of them, ready for interleaving
+static inline uint64_t spreadBits (uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+static inline uint64_t mortonCode (const ImageSpace::Point &point)
+{
+    uint64_t code = 0;
+    for (int i=0; i<3; i++)
+    {
+        const double value = std::round(static_cast<double>(point[i]));
+        const uint64_t coord = (value <= 0.0 ? 0 : static_cast<uint64_t>(std::min(value, double(0x1fffff))));
+        code |= spreadBits(coord) << i;
+    }
+    return code;
+}
+
+MaskSeedGenerator::MaskSeedGenerator (const Image<short,3> &mask, const Mode mode, const size_t nStreamlines)
+    : mode(mode), nStreamlines(nStreamlines)
+{
+    const Image<short,3>::ArrayIndex &maskDims = mask.dim();
+    for (int i=0; i<3; i++)
+        dims[i] = static_cast<int>(maskDims[i]);
+    
+    for (size_t i=0; i<mask.size(); i++)
+    {
+        if (mask[i] != 0)
+            voxels.push_back(i);
+    }
+    
+    // The smallest cubic grid with at least one cell per streamline
+    strata = 1;
+    while (static_cast<size_t>(strata * strata * strata) < nStreamlines)
+        strata++;
+}
+
+ImageSpace::Point MaskSeedGenerator::seed (const size_t n, size_t &siteIndex)
+{
+    if (voxels.empty())
+        throw std::runtime_error("Seed mask is empty");
+    
+    if (mode == Mode::Random)
+    {
+        siteIndex = std::min(static_cast<size_t>(R::unif_rand() * voxels.size()), voxels.size() - 1);
+        ImageSpace::Point point = voxelLocation(voxels[siteIndex]);
+        for (int i=0; i<3; i++)
+            point[i] += R::unif_rand() - 0.5;
+        return point;
+    }
+    
+    siteIndex = n / nStreamlines;
+    ImageSpace::Point point = voxelLocation(voxels[siteIndex]);
+    if (mode == Mode::Stratified)
+    {
+        // Spread the streamlines evenly over the cells of the grid, in case
+        // their number isn't a perfect cube, and jitter within each cell
+        const size_t cells = static_cast<size_t>(strata * strata * strata);
+        const size_t cell = (n % nStreamlines) * cells / nStreamlines;
+        const size_t cellIndex[3] = { cell % strata, (cell / strata) % strata, cell / (strata * strata) };
+        for (int i=0; i<3; i++)
+            point[i] += (static_cast<double>(cellIndex[i]) + R::unif_rand()) / strata - 0.5;
+    }
+    return point;
+}
+
+SpatiallyOrderedSeedGenerator::SpatiallyOrderedSeedGenerator (SeedGenerator * const generator)
+    : generator(generator)
+{
+    // Random sites aren't known in advance, so they are left alone
+    const size_t nSites = generator->sites();
+    if (nSites == 0 || generator->count() != nSites * generator->streamlinesPerSite())
+        return;
+    
+    std::vector<uint64_t> codes(nSites);
+    for (size_t i=0; i<nSites; i++)
+        codes[i] = mortonCode(generator->site(i));
+    
+    order.resize(nSites);
+    for (size_t i=0; i<nSites; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&codes](const size_t a, const size_t b) { return codes[a] < codes[b]; });
+}
@@ -0,0 +1,128 @@
+#ifndef _SEEDS_H_
+#define _SEEDS_H_
+
+#include "Image.h"
+
+// Seed generator: produces the seed point for each streamline on demand, so
+// that the number of seeds doesn't affect memory use. Each seed belongs to a
+// "site" (an explicit point, or a mask voxel), which identifies it for the
+// purposes of routing and connectivity. Streamlines from a site are
+// generated consecutively, and one pass covers count() streamlines
+class SeedGenerator
+{
+public:
+    virtual ~SeedGenerator () {}
+    
+    virtual size_t sites () const { return 0; }
+    virtual size_t count () const { return 0; }
+    
+    // The nominal location of a site, and the number of streamlines per site
+    virtual ImageSpace::Point site (const size_t n) const { return ImageSpace::Point(); }
+    virtual size_t streamlinesPerSite () const { return 1; }
+    
+    // Whether seeds are already placed at subvoxel positions, in which case
+    // the tracker shouldn't add its own jitter
+    virtual bool subvoxel () const { return false; }
+    
+    // The seed for the nth streamline in the pass, and the site it belongs to
+    virtual ImageSpace::Point seed (const size_t n, size_t &siteIndex) = 0;
+};
+
+// Explicit seed points, each used for a fixed number of streamlines
+class PointSeedGenerator : public SeedGenerator
+{
+private:
+    std::vector<ImageSpace::Point> points;
+    size_t perSeed;
+    
+public:
+    PointSeedGenerator (const std::vector<ImageSpace::Point> &points, const size_t perSeed)
+        : points(points), perSeed(perSeed) {}
+    
+    size_t sites () const override { return points.size(); }
+    size_t count () const override { return points.size() * perSeed; }
+    ImageSpace::Point site (const size_t n) const override { return points[n]; }
+    size_t streamlinesPerSite () const override { return perSeed; }
+    
+    ImageSpace::Point seed (const size_t n, size_t &siteIndex) override
+    {
+        siteIndex = n / perSeed;
+        return points[siteIndex];
+    }
+};
+
+// Seeds drawn from the nonzero voxels of a mask. In voxel mode, "count"
+// streamlines are generated from the centre of each voxel; in stratified
+// mode, each of them starts at a random point within its own subregion of the
+// voxel; and in random mode, "count" streamlines in total are seeded
+// uniformly within the mask. Only the voxel indices are stored
+class MaskSeedGenerator : public SeedGenerator
+{
+public:
+    enum struct Mode { Voxel, Stratified, Random };
+    
+private:
+    Mode mode;
+    size_t nStreamlines;
+    ImageSpace::DimVector dims;
+    std::vector<size_t> voxels;
+    int strata;
+    
+    ImageSpace::Point voxelLocation (const size_t index) const
+    {
+        ImageSpace::Point point;
+        point[0] = static_cast<ImageSpace::Element>(index % dims[0]);
+        point[1] = static_cast<ImageSpace::Element>((index / dims[0]) % dims[1]);
+        point[2] = static_cast<ImageSpace::Element>(index / (static_cast<size_t>(dims[0]) * dims[1]));
+        return point;
+    }
+    
+public:
+    MaskSeedGenerator (const Image<short,3> &mask, const Mode mode, const size_t nStreamlines);
+    
+    size_t sites () const override { return voxels.size(); }
+    size_t count () const override { return (mode == Mode::Random ? nStreamlines : voxels.size() * nStreamlines); }
+    ImageSpace::Point site (const size_t n) const override { return voxelLocation(voxels[n]); }
+    size_t streamlinesPerSite () const override { return (mode == Mode::Random ? 1 : nStreamlines); }
+    bool subvoxel () const override { return (mode != Mode::Voxel); }
+    
+    ImageSpace::Point seed (const size_t n, size_t &siteIndex) override;
+};
+
+// Visits the sites of another generator in the order of a Morton (Z-order)
+// curve through their locations, so that consecutive streamlines start close
+// together and reuse the same parts of the diffusion model. Site indices are
+// unchanged, so seed IDs still refer to the original order. Sites are chosen
+// on the fly in random mode, so that isn't reordered. The wrapped generator
+// is owned by this object
+class SpatiallyOrderedSeedGenerator : public SeedGenerator
+{
+private:
+    SeedGenerator *generator;
+    std::vector<size_t> order;
+    
+public:
+    explicit SpatiallyOrderedSeedGenerator (SeedGenerator * const generator);
+    
+    ~SpatiallyOrderedSeedGenerator ()
+    {
+        delete generator;
+    }
+    
+    size_t sites () const override { return generator->sites(); }
+    size_t count () const override { return generator->count(); }
+    ImageSpace::Point site (const size_t n) const override { return generator->site(n); }
+    size_t streamlinesPerSite () const override { return generator->streamlinesPerSite(); }
+    bool subvoxel () const override { return generator->subvoxel(); }
+    
+    ImageSpace::Point seed (const size_t n, size_t &siteIndex) override
+    {
+        if (order.empty())
+            return generator->seed(n, siteIndex);
+        
+        const size_t perSite = generator->streamlinesPerSite();
+        return generator->seed(order[n / perSite] * perSite + n % perSite, siteIndex);
+    }
+};
+
+#endif
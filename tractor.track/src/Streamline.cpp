@@ -71,6 +71,144 @@ void Streamline::trim (std::vector<ImageSpace::Point> &points, const double maxL
     }
 }
 
+std::array<double,3> Streamline::getScales () const
+{
+    if (!this->hasImageSpace())
+        throw std::runtime_error("Streamline has no image space information");
+    
+    std::array<double,3> scales = {{ 1.0, 1.0, 1.0 }};
+    if (pointType == PointType::Voxel)
+    {
+        for (int j=0; j<3; j++)
+            scales[j] = fabs(space->pixdim[j]);
+    }
+    return scales;
+}
+
+void Streamline::resample (std::vector<ImageSpace::Point> &points, const double spacing) const
+{
+    const size_t nPoints = points.size();
+    if (nPoints < 2)
+        return;
+    
+    const std::array<double,3> scales = getScales();
+    
+    // Cumulative real-world distance to each point
+    std::vector<double> distances(nPoints, 0.0);
+    for (size_t i=1; i<nPoints; i++)
+    {
+        double squaredNorm = 0.0;
+        for (int j=0; j<3; j++)
+        {
+            const double step = (points[i][j] - points[i-1][j]) * scales[j];
+            squaredNorm += step * step;
+        }
+        distances[i] = distances[i-1] + sqrt(squaredNorm);
+    }
+    
+    const double length = distances.back();
+    if (length == 0.0)
+    {
+        points.resize(1);
+        return;
+    }
+    
+    // Adjust the spacing so that the final point falls at the end
+    const size_t nSteps = std::max(static_cast<size_t>(ceil(length / spacing)), size_t(1));
+    const double step = length / nSteps;
+    
+    std::vector<ImageSpace::Point> result(nSteps + 1);
+    result[0] = points[0];
+    result[nSteps] = points[nPoints-1];
+    size_t segment = 1;
+    for (size_t k=1; k<nSteps; k++)
+    {
+        const double target = k * step;
+        while (segment < nPoints - 1 && distances[segment] < target)
+            segment++;
+        
+        const double segmentLength = distances[segment] - distances[segment-1];
+        const double fraction = (segmentLength > 0.0 ? (target - distances[segment-1]) / segmentLength : 0.0);
+        for (int j=0; j<3; j++)
+            result[k][j] = points[segment-1][j] + static_cast<ImageSpace::Element>(fraction * (points[segment][j] - points[segment-1][j]));
+    }
+    
+    points.swap(result);
+}
+
+void Streamline::simplify (std::vector<ImageSpace::Point> &points, const double tolerance) const
+{
+    const size_t nPoints = points.size();
+    if (nPoints < 3)
+        return;
+    
+    const std::array<double,3> scales = getScales();
+    
+    // Squared real-world distance from a point to the line segment between two others
+    auto distance = [&](const ImageSpace::Point &point, const ImageSpace::Point &start, const ImageSpace::Point &end) -> double {
+        double segment[3], offset[3];
+        double segmentNorm = 0.0, projection = 0.0;
+        for (int j=0; j<3; j++)
+        {
+            segment[j] = (end[j] - start[j]) * scales[j];
+            offset[j] = (point[j] - start[j]) * scales[j];
+            segmentNorm += segment[j] * segment[j];
+            projection += segment[j] * offset[j];
+        }
+        const double t = (segmentNorm > 0.0 ? std::min(std::max(projection / segmentNorm, 0.0), 1.0) : 0.0);
+        double result = 0.0;
+        for (int j=0; j<3; j++)
+        {
+            const double residual = offset[j] - t * segment[j];
+            result += residual * residual;
+        }
+        return result;
+    };
+    
+    // Douglas-Peucker, using an explicit stack of index ranges rather than
+    // recursion, since streamlines can be long
+    const double squaredTolerance = tolerance * tolerance;
+    std::vector<bool> keep(nPoints, false);
+    keep[0] = keep[nPoints-1] = true;
+    std::vector<std::pair<size_t,size_t>> ranges;
+    ranges.push_back(std::make_pair(size_t(0), nPoints-1));
+    while (!ranges.empty())
+    {
+        const size_t first = ranges.back().first;
+        const size_t last = ranges.back().second;
+        ranges.pop_back();
+        
+        double maxDistance = 0.0;
+        size_t maxIndex = first;
+        for (size_t i=first+1; i<last; i++)
+        {
+            const double currentDistance = distance(points[i], points[first], points[last]);
+            if (currentDistance > maxDistance)
+            {
+                maxDistance = currentDistance;
+                maxIndex = i;
+            }
+        }
+        
+        if (maxDistance > squaredTolerance)
+        {
+            keep[maxIndex] = true;
+            if (maxIndex - first > 1)
+                ranges.push_back(std::make_pair(first, maxIndex));
+            if (last - maxIndex > 1)
+                ranges.push_back(std::make_pair(maxIndex, last));
+        }
+    }
+    
+    size_t n = 0;
+    for (size_t i=0; i<nPoints; i++)
+    {
+        if (keep[i])
+            points[n++] = points[i];
+    }
+    points.resize(n);
+}
+
 std::vector<ImageSpace::Point> Streamline::getPoints () const
 {
     std::vector<ImageSpace::Point> result;
@@ -113,26 +251,51 @@ bool StreamlineLabeller::process (Streamline &data)
     // The new labels replace any old ones
     data.clearLabels();
     
-    const PointType pointType = data.getPointType();
+    const ImageSpace *space = labelMap.imageSpace();
+    if (space == nullptr)
+        throw std::runtime_error("No space is associated with the image");
+    
+    points.clear();
+    data.visitPoints([this](const ImageSpace::Point &point) { points.push_back(point); });
+    space->toVoxel(points, data.getPointType());
     
-    for (const ImageSpace::Point &point : data.getLeftPoints())
+    // Convert to flat indices, skipping runs within a single voxel (which is
+    // the common case, since step lengths are usually sub-voxel)
+    const Image<int,3>::ArrayIndex &dims = labelMap.dim();
+    const size_t strides[3] = { 1, dims[0], dims[0] * dims[1] };
+    indices.clear();
+    size_t previous = std::numeric_limits<size_t>::max();
+    for (const ImageSpace::Point &point : points)
     {
-        const int &value = labelMap.at(point, pointType);
-        if (value > 0)
-            data.addLabel(value);
+        size_t index = 0;
+        for (int i=0; i<3; i++)
+        {
+            if (point[i] < 0.0 || point[i] >= static_cast<ImageSpace::Element>(dims[i]))
+                throw std::out_of_range("Array index is out of range");
+            index += strides[i] * static_cast<size_t>(point[i]);
+        }
+        if (index != previous)
+        {
+            indices.push_back(index);
+            previous = index;
+        }
     }
     
-    for (const ImageSpace::Point &point : data.getRightPoints())
+    // Gather the label values; revisited voxels are caught by the bitmap
+    const int *values = labelMap.data().data();
+    hits.clear();
+    for (const size_t &index : indices)
     {
-        const int &value = labelMap.at(point, pointType);
+        const int value = values[index];
         if (value > 0)
-            data.addLabel(value);
+            hits.insert(value);
     }
     
+    data.setLabels(hits.toLabelSet());
     return true;
 }
 
-void StreamlineLabelMatcher::process (const std::set<int> &hits, const size_t &index)
+void StreamlineLabelMatcher::process (const LabelSet &hits, const size_t &index)
 {
     bool isMatch = (combine == CombineOperation::And);
     for (size_t i=0; i<labels.size(); i++)
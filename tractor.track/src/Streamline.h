@@ -4,13 +4,14 @@
 #include "Image.h"
 #include "DataSource.h"
 #include "BinaryStream.h"
+#include "LabelSet.h"
 
 #include <Rcpp.h>
 
 class Streamline : public ImageSpaceEmbedded
 {
 public:
-    enum struct TerminationReason { Unknown, Bounds, Mask, OneWay, Target, NoData, Loop, Curvature };
+    enum struct TerminationReason { Unknown, Bounds, Mask, OneWay, Target, NoData, Loop, Curvature, Exclusion };
     
 private:
     // A list of points along the streamline; the path is considered
@@ -24,11 +25,15 @@ private:
     
     // A set of integer labels associated with the streamline, indicating, for
     // example, the anatomical regions that the streamline passes through
-    std::set<int> labels;
+    LabelSet labels;
     
     // Reasons for termination on each side
     TerminationReason leftTerminationReason = TerminationReason::Unknown, rightTerminationReason = TerminationReason::Unknown;
     
+    // The index of the seed point that the streamline was generated from, or
+    // -1 if this is not known
+    int seedId = -1;
+    
 protected:
     // A boolean value indicating whether or not the points are equally spaced
     // (in real-world terms)
@@ -36,6 +41,11 @@ protected:
     
     double getLength (const std::vector<ImageSpace::Point> &points) const;
     void trim (std::vector<ImageSpace::Point> &points, const double maxLength);
+    void resample (std::vector<ImageSpace::Point> &points, const double spacing) const;
+    void simplify (std::vector<ImageSpace::Point> &points, const double tolerance) const;
+    
+    // Real-world lengths per unit of each coordinate
+    std::array<double,3> getScales () const;
     
 public:
     Streamline () {}
@@ -51,6 +61,25 @@ public:
     const std::vector<ImageSpace::Point> & getLeftPoints () const { return leftPoints; }
     const std::vector<ImageSpace::Point> & getRightPoints () const { return rightPoints; }
     std::vector<ImageSpace::Point> getPoints () const;
+    
+    // Applies a function to each point in the order returned by getPoints(),
+    // without creating a combined vector
+    template <class Function>
+    void visitPoints (Function function) const
+    {
+        if (leftPoints.size() > 1)
+        {
+            for (auto it=leftPoints.crbegin(); it!=leftPoints.crend()-1; it++)
+                function(*it);
+        }
+        if (rightPoints.size() > 0)
+        {
+            for (auto it=rightPoints.cbegin(); it!=rightPoints.cend(); it++)
+                function(*it);
+        }
+        else if (leftPoints.size() > 0)
+            function(leftPoints[0]);
+    }
     PointType getPointType () const { return pointType; }
     bool usesFixedSpacing () const { return fixedSpacing; }
     
@@ -60,12 +89,30 @@ public:
     void trimLeft (const double maxLength)  { trim(leftPoints,maxLength); }
     void trimRight (const double maxLength) { trim(rightPoints,maxLength); }
     
+    // Each side is processed separately from the seed point outwards, so the
+    // seed index remains valid. Resampling spaces the points on each side
+    // equally, with the spacing adjusted slightly to preserve the end point;
+    // simplification removes points within the tolerance of the path
+    void resample (const double spacing)
+    {
+        resample(leftPoints, spacing);
+        resample(rightPoints, spacing);
+        fixedSpacing = true;
+    }
+    
+    void simplify (const double tolerance)
+    {
+        simplify(leftPoints, tolerance);
+        simplify(rightPoints, tolerance);
+        fixedSpacing = false;
+    }
+    
     int nLabels () const                            { return static_cast<int>(labels.size()); }
-    bool addLabel (const int label)                 { return labels.insert(label).second; }
+    bool addLabel (const int label)                 { return labels.insert(label); }
     bool removeLabel (const int label)              { return (labels.erase(label) == 1); }
     bool hasLabel (const int label) const           { return (labels.count(label) == 1); }
-    const std::set<int> & getLabels () const        { return labels; }
-    void setLabels (const std::set<int> &labels)    { this->labels = labels; }
+    const LabelSet & getLabels () const             { return labels; }
+    void setLabels (const LabelSet &labels)         { this->labels = labels; }
     void clearLabels ()                             { labels.clear(); }
     
     TerminationReason getLeftTerminationReason () const     { return leftTerminationReason; }
@@ -75,14 +122,25 @@ public:
         leftTerminationReason = left;
         rightTerminationReason = right;
     }
+    
+    int getSeedId () const              { return seedId; }
+    void setSeedId (const int seedId)   { this->seedId = seedId; }
 };
 
-// This manipulator replaces any existing labels with hits within an image
+// Labels streamlines with the positive values of a parcellation image that
+// they pass through. Points are converted to voxel locations as a batch, then
+// to flat indices with consecutive repeats of the same voxel dropped, and the
+// labels are then gathered in a single pass over the index buffer
 class StreamlineLabeller : public DataManipulator<Streamline>
 {
 private:
     Image<int,3> labelMap;
     
+    // Working storage, kept between streamlines to avoid reallocation
+    std::vector<ImageSpace::Point> points;
+    std::vector<size_t> indices;
+    LabelBitmap hits;
+    
 public:
     StreamlineLabeller (const Image<int,3> &labelMap)
         : labelMap(labelMap) {}
@@ -111,6 +169,62 @@ public:
     }
 };
 
+// Reduces the number of points in each streamline, by resampling to a fixed
+// spacing and/or simplifying within a tolerance (both in real-world units)
+class StreamlineResampler : public DataManipulator<Streamline>
+{
+private:
+    double spacing, tolerance;
+    
+public:
+    StreamlineResampler (const double spacing, const double tolerance)
+        : spacing(spacing), tolerance(tolerance) {}
+    
+    bool process (Streamline &data) override
+    {
+        if (spacing > 0.0)
+            data.resample(spacing);
+        if (tolerance > 0.0)
+            data.simplify(tolerance);
+        return true;
+    }
+};
+
+// Passes a resampled copy of each streamline on to another sink, so that point
+// reduction only affects outputs that store the points themselves: visitation
+// maps, for example, need every voxel along the path. The wrapped sink is
+// owned by this object
+class ResamplingDataSink : public DataSink<Streamline>
+{
+private:
+    StreamlineResampler resampler;
+    DataSink<Streamline> *sink;
+    
+public:
+    // Delete the default constructor
+    ResamplingDataSink () = delete;
+    
+    ResamplingDataSink (DataSink<Streamline> * const sink, const double spacing, const double tolerance)
+        : resampler(spacing, tolerance), sink(sink) {}
+    
+    ~ResamplingDataSink ()
+    {
+        delete sink;
+    }
+    
+    void setup (const size_t &count) override { sink->setup(count); }
+    
+    void put (const Streamline &data) override
+    {
+        Streamline copy(data);
+        resampler.process(copy);
+        sink->put(copy);
+    }
+    
+    void finish () override { sink->finish(); }
+    void done () override { sink->done(); }
+};
+
 class StreamlineLabelMatcher : public DataSink<Streamline>
 {
 public:
@@ -126,7 +240,7 @@ private:
     
     // Checks whether the specified set of label hits matches the requirements,
     // and stores the associated index in the list(s) of matches if so
-    void process (const std::set<int> &hits, const size_t &index);
+    void process (const LabelSet &hits, const size_t &index);
     
 public:
     // Delete the default constructor
@@ -144,7 +258,7 @@ public:
         currentStreamline++;
     }
     
-    void put (const std::vector<std::set<int>> &hits)
+    void put (const std::vector<LabelSet> &hits)
     {
         for (size_t i=0; i<hits.size(); i++)
             process(hits[i], i);
@@ -4,62 +4,171 @@
 
 using namespace std;
 
-Streamline Tracker::run ()
+// Check whether the elements in the range [begin,end) appear in order, but not
+// necessarily contiguously, in the sequence
+template <class Iterator>
+static bool isSubsequence (Iterator begin, Iterator end, const std::vector<int> &sequence)
 {
-    if (model == nullptr)
-        throw std::runtime_error("No diffusion model has been specified");
+    Iterator it = begin;
+    for (size_t i=0; i<sequence.size() && it!=end; i++)
+    {
+        if (sequence[i] == *it)
+            it++;
+    }
+    return (it == end);
+}
+
+void Tracker::setMask (const RNifti::NiftiImage &mask, const bool crop)
+{
+    const Image<short,3> image(mask);
+    const ImageRaster<3>::ArrayIndex &dims = image.dim();
     
-    const ImageSpace::DimVector imageDims = model->imageSpace()->dim;
-    const ImageSpace::PixdimVector voxelDims = model->imageSpace()->pixdim;
+    // Find the bounding box of the nonzero region
+    ImageRaster<3>::ArrayIndex loc, lower = dims, upper = {{ 0, 0, 0 }};
+    bool empty = true;
+    for (loc[2]=0; loc[2]<dims[2]; loc[2]++)
+    {
+        for (loc[1]=0; loc[1]<dims[1]; loc[1]++)
+        {
+            for (loc[0]=0; loc[0]<dims[0]; loc[0]++)
+            {
+                if (image[loc] != 0)
+                {
+                    for (int i=0; i<3; i++)
+                    {
+                        lower[i] = std::min(lower[i], loc[i]);
+                        upper[i] = std::max(upper[i], loc[i]);
+                    }
+                    empty = false;
+                }
+            }
+        }
+    }
     
-    Rcpp::Rcout << std::fixed;
-    Rcpp::Rcout.precision(3);
-    logger.debug1.indent() << "Tracking from seed point " << seed << endl;
+    delete croppedModel;
+    croppedModel = nullptr;
+    delete croppedVoxelInfo;
+    croppedVoxelInfo = nullptr;
+    delete loopcheck;
+    loopcheck = nullptr;
     
-    if (visited == nullptr)
+    for (int i=0; i<3; i++)
     {
-        logger.debug2.indent() << "Creating visitation map" << endl;
-        visited = new Image<bool,3>(imageDims, false);
+        fullDims[i] = static_cast<RNifti::NiftiImage::dim_t>(dims[i]);
+        cropOrigin[i] = 0;
     }
-    else
+    
+    if (crop && !empty)
     {
-        logger.debug2.indent() << "Resetting visitation map" << endl;
-        visited->fill(false);
+        // The margin ensures that the first voxel outside the mask in any
+        // direction is within the cropped region, and that probabilistic
+        // rounding at the edge of the mask is unaffected by the crop
+        ImageSpace::DimVector origin, boxExtent;
+        double fraction = 1.0;
+        for (int i=0; i<3; i++)
+        {
+            origin[i] = static_cast<RNifti::NiftiImage::dim_t>(lower[i] > 0 ? lower[i] - 1 : 0);
+            boxExtent[i] = static_cast<RNifti::NiftiImage::dim_t>(std::min(upper[i] + 2, dims[i])) - origin[i];
+            fraction *= static_cast<double>(boxExtent[i]) / dims[i];
+        }
+        
+        if (fraction <= MAX_CROP_FRACTION)
+            croppedModel = model->crop(origin, boxExtent);
+        if (croppedModel != nullptr)
+        {
+            logger.debug1.indent() << "Cropping to " << boxExtent[0] << "x" << boxExtent[1] << "x" << boxExtent[2] << " voxel region (" << static_cast<int>(round(fraction * 100.0)) << "% of full volume)" << endl;
+            cropOrigin = origin;
+            croppedVoxelInfo = new Image<VoxelInfo,3,TrackingLayout>(boxExtent);
+        }
     }
     
+    delete voxelInfo;
+    voxelInfo = new Image<VoxelInfo,3,TrackingLayout>(fullDims);
+    updateVoxelInfo<short>(mask, [](VoxelInfo &info, const short value) {
+        if (value != 0)
+            info.flags |= VoxelInfo::Mask;
+    });
+    haveMask = true;
+    haveTargets = haveExclusion = false;
+}
+
+Streamline Tracker::run ()
+{
+    if (model == nullptr)
+        throw std::runtime_error("No diffusion model has been specified");
+    if (!haveMask)
+        throw std::runtime_error("No tracking mask has been specified");
+    if (!requiredLabels.empty() && !haveTargets)
+        throw std::runtime_error("Required target labels have been specified without a target image");
+    
+    Rcpp::Rcout << std::fixed;
+    Rcpp::Rcout.precision(3);
+    logger.debug1.indent() << "Tracking from seed point " << seed << endl;
+    
+    // Loopcheck blocks cover the full image grid, so that cropping doesn't
+    // affect which locations share a block
     if (flags["loopcheck"] && loopcheck == NULL)
     {
         logger.debug2.indent() << "Creating loopcheck vector field" << endl;
         ImageSpace::DimVector loopcheckDims;
         for (int i=0; i<3; i++)
-            loopcheckDims[i] = static_cast<int>(ceil(imageDims[i] / LOOPCHECK_RATIO));
+            loopcheckDims[i] = static_cast<int>(ceil(fullDims[i] / LOOPCHECK_RATIO));
         loopcheck = new Image<ImageSpace::Vector,3>(loopcheckDims, ImageSpace::zeroVector());
     }
     
+    // With adaptive stepping, each sampled direction may be followed for up
+    // to this many steps of the base length
+    const int maxSubsteps = std::max(1, static_cast<int>(floor(maxStepLength / stepLength + 1e-6)));
+    
     bool starting = true;
     bool rightwardsVectorValid = (ImageSpace::norm(rightwardsVector) != 0.0);
     ImageSpace::Point loc;
-    Image<bool,3>::ArrayIndex roundedLoc;
+    Image<VoxelInfo,3,TrackingLayout>::ArrayIndex roundedLoc;
     Image<ImageSpace::Vector,3>::ArrayIndex loopcheckLoc;
     size_t vectorLoc;
     ImageSpace::Vector previousStep = ImageSpace::zeroVector();
     
     std::vector<ImageSpace::Point> leftPoints, rightPoints;
-    std::set<int> labels;
+    LabelBitmap labels;
     
+    // Sequences of required regions entered in each direction, if order matters
+    std::vector<int> entries[2];
+    rejected = false;
+    
+    // The seed is given in full-image coordinates
     ImageSpace::Point currentSeed = seed;
-    if (jitter)
+    bool seedInBounds = true;
+    for (int i=0; i<3; i++)
     {
-        for (int i=0; i<3; i++)
+        if (jitter)
             currentSeed[i] += R::unif_rand() - 0.5;
+        const int roundedSeed = static_cast<int>(round(currentSeed[i]));
+        if (roundedSeed < 0 || roundedSeed > fullDims[i] - 1)
+            seedInBounds = false;
+        else
+            roundedLoc[i] = roundedSeed;
     }
     
-    int startTarget = 0;
-    if (targetData != NULL)
+    // Use the cropped space if the seed is inside the mask, otherwise the
+    // streamline may travel anywhere before entering it
+    DiffusionModel *trackingModel = model;
+    Image<VoxelInfo,3,TrackingLayout> *records = voxelInfo;
+    ImageSpace::DimVector origin = {{ 0, 0, 0 }};
+    if (seedInBounds && croppedModel != nullptr && (voxelInfo->at(roundedLoc).flags & VoxelInfo::Mask))
     {
+        trackingModel = croppedModel;
+        records = croppedVoxelInfo;
+        origin = cropOrigin;
         for (int i=0; i<3; i++)
-            roundedLoc[i] = static_cast<int>(round(currentSeed[i]));
-        startTarget = targetData->at(roundedLoc);
+            currentSeed[i] -= origin[i];
+    }
+    const ImageSpace::DimVector imageDims = trackingModel->imageSpace()->dim;
+    const ImageSpace::PixdimVector voxelDims = trackingModel->imageSpace()->pixdim;
+    
+    int startTarget = 0;
+    if (haveTargets && seedInBounds)
+    {
+        startTarget = voxelInfo->at(roundedLoc).target;
         if (startTarget < 0)
             startTarget = 0;
     }
@@ -77,8 +186,9 @@ Streamline Tracker::run ()
         if (rightwardsVectorValid)
             previousStep = (dir==0 ? rightwardsVector : -rightwardsVector);
         
-        int step;
+        int step, samples = 0;
         int previouslyInsideMask = -1;
+        int substeps = 1, substepsRemaining = 0;
         
         // Run the tracking
         for (step=0; step<(maxSteps/2); step++)
@@ -96,33 +206,62 @@ Streamline Tracker::run ()
             }
             if (!inBounds)
             {
-                terminationReasons[dir] = Streamline::TerminationReason::Bounds;
-                logger.debug2.indent() << "Terminating: stepped out of bounds" << endl;
+                // Everything outside the cropped region is outside the mask,
+                // but the edge of the full image is a hard limit
+                bool inFullBounds = true;
+                for (int i=0; i<3; i++)
+                {
+                    const int fullRoundedLoc = static_cast<int>(round(loc[i])) + origin[i];
+                    if (fullRoundedLoc < 0 || fullRoundedLoc > fullDims[i] - 1)
+                        inFullBounds = false;
+                }
+                
+                if (inFullBounds && previouslyInsideMask == 1)
+                {
+                    terminationReasons[dir] = Streamline::TerminationReason::Mask;
+                    logger.debug2.indent() << "Terminating: stepped outside tracking mask" << endl;
+                }
+                else
+                {
+                    terminationReasons[dir] = Streamline::TerminationReason::Bounds;
+                    logger.debug2.indent() << "Terminating: stepped out of bounds" << endl;
+                }
                 break;
             }
             
-            // Index for current location
-            visited->imageRaster().flattenIndex(roundedLoc, vectorLoc);
+            // Index for current location, and the metadata record there
+            records->imageRaster().flattenIndex(roundedLoc, vectorLoc);
+            const VoxelInfo &info = (*records)[vectorLoc];
             
             // Stop if we've stepped outside the mask, possibly deferring termination if required
-            if ((*maskData)[vectorLoc] == 0 && previouslyInsideMask == 1)
+            const bool insideMask = ((info.flags & VoxelInfo::Mask) != 0);
+            if (!insideMask && previouslyInsideMask == 1)
             {
                 terminationReasons[dir] = Streamline::TerminationReason::Mask;
                 logger.debug2.indent() << "Terminating: stepped outside tracking mask" << endl;
                 break;
             }
-            previouslyInsideMask = ((*maskData)[vectorLoc] == 0 ? 0 : 1);
+            previouslyInsideMask = (insideMask ? 1 : 0);
             
-            // Mark visit
-            visited->at(vectorLoc) = true;
+            // Abandon the whole streamline as soon as it enters an exclusion region
+            if (info.flags & VoxelInfo::Exclusion)
+            {
+                terminationReasons[dir] = Streamline::TerminationReason::Exclusion;
+                rejected = true;
+                logger.debug2.indent() << "Terminating: entered exclusion region" << endl;
+                break;
+            }
             
             // Store current (unrounded) location if required
             // NB: This part of the code must always be reached at the seed point
+            ImageSpace::Point fullLoc = loc;
+            for (int i=0; i<3; i++)
+                fullLoc[i] += origin[i];
             if (dir == 0)
-                rightPoints.push_back(loc);
+                rightPoints.push_back(fullLoc);
             else
             {
-                leftPoints.push_back(loc);
+                leftPoints.push_back(fullLoc);
                 
                 if (flags["one-way"])
                 {
@@ -133,11 +272,14 @@ Streamline Tracker::run ()
             }
             
             // Add label if we're in a target area; terminate if required and we've left the starting region
-            if (targetData != NULL && (*targetData)[vectorLoc] > 0)
+            if (info.target > 0)
             {
-                labels.insert((*targetData)[vectorLoc]);
+                const int label = info.target;
+                labels.insert(label);
+                if (orderedRequirements && (entries[dir].empty() || entries[dir].back() != label) && std::find(requiredLabels.begin(), requiredLabels.end(), label) != requiredLabels.end())
+                    entries[dir].push_back(label);
                 
-                if (flags["terminate-targets"] && (*targetData)[vectorLoc] != startTarget)
+                if (flags["terminate-targets"] && label != startTarget)
                 {
                     terminationReasons[dir] = Streamline::TerminationReason::Target;
                     logger.debug2.indent() << "Terminating: target hit" << endl;
@@ -145,21 +287,30 @@ Streamline Tracker::run ()
                 }
             }
             
-            // Sample a direction for the current step
-            ImageSpace::Vector currentStep = model->sampleDirection(loc, previousStep);
-            logger.debug3.indent() << "Sampled step direction is " << currentStep << endl;
-            if (ImageSpace::norm(currentStep) == 0.0)
+            // Between direction samples, carry on in the same direction
+            const bool sampling = (substepsRemaining == 0);
+            ImageSpace::Vector currentStep = previousStep;
+            if (sampling)
             {
-                terminationReasons[dir] = Streamline::TerminationReason::NoData;
-                logger.debug2.indent() << "Terminating: zero step vector" << endl;
-                break;
+                // Sample a direction for the current step
+                currentStep = trackingModel->sampleDirection(loc, previousStep);
+                samples++;
+                logger.debug3.indent() << "Sampled step direction is " << currentStep << endl;
+                if (ImageSpace::norm(currentStep) == 0.0)
+                {
+                    terminationReasons[dir] = Streamline::TerminationReason::NoData;
+                    logger.debug2.indent() << "Terminating: zero step vector" << endl;
+                    break;
+                }
             }
+            else
+                substepsRemaining--;
             
             // Perform loopcheck if requested: within the current 5x5x5 voxel block, has the streamline been going in the opposite direction?
             if (flags["loopcheck"])
             {
                 for (int i=0; i<3; i++)
-                    loopcheckLoc[i] = static_cast<int>(round((loc[i] + 0.5) / LOOPCHECK_RATIO - 0.5));
+                    loopcheckLoc[i] = static_cast<int>(round((loc[i] + origin[i] + 0.5) / LOOPCHECK_RATIO - 0.5));
                 
                 float loopcheckInnerProduct = ImageSpace::dot(loopcheck->at(loopcheckLoc), previousStep);
                 if (loopcheckInnerProduct < 0.0)
@@ -175,7 +326,7 @@ Streamline Tracker::run ()
             // Reverse the sampled direction if its inner product with the previous step is negative
             // If there is no previous step (or rightwards vector), we're heading right so the sign is positive
             float sign;
-            if (starting && !rightwardsVectorValid)
+            if (!sampling || (starting && !rightwardsVectorValid))
                 sign = 1.0;
             else
             {
@@ -187,6 +338,14 @@ Streamline Tracker::run ()
                     break;
                 }
                 sign = (innerProduct > 0.0) ? 1.0 : -1.0;
+                
+                // Follow this direction for longer if it agrees closely with
+                // the last one; otherwise drop back to a single step
+                if (maxSubsteps > 1)
+                {
+                    substeps = (fabs(innerProduct) >= COHERENCE_THRESHOLD ? std::min(2 * substeps, maxSubsteps) : 1);
+                    substepsRemaining = substeps - 1;
+                }
             }
             
             // Update streamline front and previous step
@@ -210,13 +369,208 @@ Streamline Tracker::run ()
             }
         }
         
-        logger.debug2.indent() << "Completed " << step << " steps" << endl;
+        logger.debug2.indent() << "Completed " << step << " steps, with " << samples << " direction samples" << endl;
+        
+        // No point tracking the other way if the streamline will be discarded
+        if (rejected)
+            break;
+    }
+    
+    if (!rejected && !requiredLabels.empty())
+    {
+        if (orderedRequirements)
+        {
+            // The full sequence runs from the left end to the right end; the
+            // required order may be satisfied in either direction
+            std::vector<int> sequence(entries[1].rbegin(), entries[1].rend());
+            sequence.insert(sequence.end(), entries[0].begin(), entries[0].end());
+            rejected = !(isSubsequence(requiredLabels.begin(), requiredLabels.end(), sequence) || isSubsequence(requiredLabels.rbegin(), requiredLabels.rend(), sequence));
+        }
+        else
+            rejected = !std::all_of(requiredLabels.begin(), requiredLabels.end(), [&labels](const int label) { return labels.count(label) > 0; });
+        
+        if (rejected)
+            logger.debug2.indent() << "Rejecting: required targets not reached" << endl;
     }
     
     logger.debug1.indent() << "Tracking finished" << endl;
     
     Streamline streamline(leftPoints, rightPoints, PointType::Voxel, model->imageSpace(), true);
     streamline.setTerminationReasons(terminationReasons[0], terminationReasons[1]);
-    streamline.setLabels(labels);
+    streamline.setLabels(labels.toLabelSet());
     return streamline;
 }
+
+void TractographyDataSource::setShard (const size_t index, const size_t nShards, const uint32_t seed)
+{
+    if (quota > 0)
+        throw std::runtime_error("A streamline quota cannot be used in a sharded run");
+    if (nShards == 0 || index >= nShards)
+        throw std::runtime_error("Shard index is out of range");
+    
+    // Shards are divided by block rather than by site, so that the work is
+    // shared even when there are fewer sites than shards
+    const size_t count = generator->count();
+    const size_t length = blockLength();
+    const size_t nBlocks = (count + length - 1) / length;
+    firstStreamline = std::min(count, (index * nBlocks / nShards) * length);
+    totalStreamlines = std::min(count, ((index + 1) * nBlocks / nShards) * length);
+    
+    sharded = true;
+    shardSeed = seed;
+}
+
+size_t TractographyDataSource::blockLength () const
+{
+    const size_t perSite = generator->streamlinesPerSite();
+    if (perSite < SHARD_BLOCK_SIZE)
+        return perSite * ((SHARD_BLOCK_SIZE + perSite - 1) / perSite);
+    else
+        return SHARD_BLOCK_SIZE;
+}
+
+bool TractographyDataSource::reseedAt (const size_t n) const
+{
+    const size_t perSite = generator->streamlinesPerSite();
+    return (n % blockLength() == 0 || (perSite >= SHARD_BLOCK_SIZE && n % perSite == 0));
+}
+
+void TractographyDataSource::reseed (const size_t n) const
+{
+    // Mix the run seed and streamline index with the SplitMix64 finaliser, so
+    // that neighbouring streamlines get unrelated seeds
+    uint64_t x = static_cast<uint64_t>(shardSeed) * 0x9e3779b97f4a7c15ULL + n;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    
+    // The most negative integer is NA in R, which set.seed() rejects
+    int32_t value = static_cast<int32_t>(x & 0xffffffff);
+    if (value == std::numeric_limits<int32_t>::min())
+        value = 0;
+    
+    // There is no C API for seeding R's generator, so go through R
+    Rcpp::Function setSeed("set.seed", Rcpp::Environment::base_namespace());
+    setSeed(value);
+}
+
+void TractographyDataSource::saveRandomSeed ()
+{
+    // Make sure R's copy of the RNG state is current
+    PutRNGstate();
+    Rcpp::Environment globalEnv = Rcpp::Environment::global_env();
+    savedRandomSeed.clear();
+    if (globalEnv.exists(".Random.seed"))
+        savedRandomSeed = Rcpp::as<std::vector<int>>(globalEnv.get(".Random.seed"));
+}
+
+void TractographyDataSource::restoreRandomSeed ()
+{
+    if (!savedRandomSeed.empty())
+    {
+        Rcpp::Environment globalEnv = Rcpp::Environment::global_env();
+        globalEnv.assign(".Random.seed", Rcpp::IntegerVector(savedRandomSeed.begin(), savedRandomSeed.end()));
+        GetRNGstate();
+    }
+}
+
+uint64_t TractographyDataSource::seedHash () const
+{
+    // FNV-1a over the bytes of each value, including the site coordinates
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto mix = [&hash](const void *data, const size_t length) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i=0; i<length; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ULL;
+        }
+    };
+    
+    const uint64_t sizes[4] = { generator->sites(), generator->streamlinesPerSite(), firstStreamline, totalStreamlines };
+    mix(sizes, sizeof(sizes));
+    for (size_t i=0; i<generator->sites(); i++)
+    {
+        const ImageSpace::Point site = generator->site(i);
+        const float coords[3] = { static_cast<float>(site[0]), static_cast<float>(site[1]), static_cast<float>(site[2]) };
+        mix(coords, sizeof(coords));
+    }
+    return hash;
+}
+
+void TractographyDataSource::primeRightwardsVector ()
+{
+    // The rightwards vector may be carried from one streamline to the next
+    // within a site, so it must match the one that would have been set by
+    // the site's earlier streamlines in an unsharded run. Once it has been
+    // set it doesn't change for the rest of the site
+    const size_t perSite = generator->streamlinesPerSite();
+    size_t siteIndex;
+    for (size_t n=firstStreamline-(firstStreamline%perSite); n<firstStreamline; n++)
+    {
+        if (reseedAt(n))
+            reseed(n);
+        const ImageSpace::Point seed = generator->seed(n, siteIndex);
+        tracker->setSeed(seed, jitter, n % perSite == 0);
+        tracker->run();
+        if (ImageSpace::norm(tracker->getRightwardsVector()) != 0.0)
+            break;
+    }
+}
+
+size_t TractographyDataSource::preferredBlockSize (const size_t blockSize)
+{
+    if (quota == 0 || acceptedStreamlines >= quota)
+        return blockSize;
+    
+    // Estimate how many more streamlines need to be generated to meet the
+    // quota, based on the acceptance rate so far, to avoid overshooting by
+    // much. Until anything has been generated, assume everything is accepted
+    const size_t remaining = quota - acceptedStreamlines;
+    size_t estimate;
+    if (currentStreamline == 0)
+        estimate = remaining;
+    else if (acceptedStreamlines == 0)
+        estimate = blockSize;
+    else
+        estimate = static_cast<size_t>(std::ceil(static_cast<double>(remaining) * currentStreamline / acceptedStreamlines));
+    
+    return std::max(size_t(1), std::min(estimate, blockSize));
+}
+
+void TractographyDataSource::saveState (BinaryOutputStream &stream) const
+{
+    // The totals and seed hash are stored to check that the run is the same on restore
+    stream.writeValue<uint64_t>(totalStreamlines);
+    stream.writeValue<uint64_t>(generator->count());
+    stream.writeValue<uint64_t>(seedHash());
+    stream.writeValue<uint64_t>(currentStreamline);
+    stream.writeValue<uint64_t>(acceptedStreamlines);
+    
+    // The rightwards vector may have been set by a streamline from the current seed
+    stream.writePoint<float>(tracker->getRightwardsVector());
+}
+
+void TractographyDataSource::restoreState (BinaryInputStream &stream)
+{
+    const size_t storedTotal = stream.readValue<uint64_t,size_t>();
+    const size_t storedCount = stream.readValue<uint64_t,size_t>();
+    const uint64_t storedHash = stream.readValue<uint64_t>();
+    if (storedTotal != totalStreamlines || storedCount != generator->count() || storedHash != seedHash())
+        throw std::runtime_error("Checkpoint does not match the current seeds and streamline count");
+    
+    resumeStreamline = stream.readValue<uint64_t,size_t>();
+    resumeAccepted = stream.readValue<uint64_t,size_t>();
+    
+    ImageSpace::Vector rightwardsVector;
+    stream.readPoint<float>(rightwardsVector);
+    tracker->restoreRightwardsVector(rightwardsVector);
+}
+
+size_t TractographyDataSource::accept (const size_t n)
+{
+    // Any streamlines beyond the quota are surplus to requirements
+    const size_t kept = (quota == 0 ? n : std::min(n, quota - acceptedStreamlines));
+    acceptedStreamlines += kept;
+    return kept;
+}
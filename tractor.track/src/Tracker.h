@@ -5,23 +5,65 @@
 #include "DiffusionModel.h"
 #include "Streamline.h"
 #include "DataSource.h"
+#include "Seeds.h"
+#include "Checkpoint.h"
 #include "Logger.h"
 
 #include <Rcpp.h>
 
 #define LOOPCHECK_RATIO 5.0
 
+// The largest fraction of the field of view for which the tracker crops
+#define MAX_CROP_FRACTION 0.5
+
+// Sharded runs reseed the RNG at the start of each block of at least this
+// many streamlines, and shards are divided at block boundaries
+#define SHARD_BLOCK_SIZE 16
+
+// The minimum inner product between successive sampled directions for the
+// adaptive step length to grow (about 10 degrees)
+#define COHERENCE_THRESHOLD 0.985
+
+// Tracking metadata for one voxel. The mask, exclusion region and target
+// label are combined so that each step reads a single small record
+struct VoxelInfo
+{
+    enum : uint16_t { Mask = 1, Exclusion = 2 };
+    
+    int32_t target = 0;
+    uint16_t flags = 0;
+};
+
 class Tracker
 {
 private:
     DiffusionModel *model = nullptr;
     
-    Image<short,3> *maskData = nullptr;
-    Image<int,3> *targetData = nullptr;
+    // When the mask occupies only part of the field of view, streamlines
+    // seeded inside the mask are tracked within a cropped copy of the model
+    // (owned by the tracker) and cropped metadata, covering the mask's
+    // bounding box plus a margin of one voxel. Such streamlines can't leave
+    // that region before terminating. Other seeds use the full model and
+    // metadata, since they may travel anywhere before entering the mask.
+    // Points are translated by the crop origin on the way in and out, so the
+    // cropping is invisible outside the tracker
+    DiffusionModel *croppedModel = nullptr;
+    ImageSpace::DimVector fullDims = {{ 0, 0, 0 }};
+    ImageSpace::DimVector cropOrigin = {{ 0, 0, 0 }};
+    
+    Image<VoxelInfo,3,TrackingLayout> *voxelInfo = nullptr;
+    Image<VoxelInfo,3,TrackingLayout> *croppedVoxelInfo = nullptr;
+    bool haveMask = false, haveTargets = false, haveExclusion = false;
     std::map<int,std::string> dictionary;
     
+    // Constraints evaluated during tracking: streamlines entering the
+    // exclusion mask, or failing to reach all required target labels (in
+    // order, if requested), are rejected
+    std::vector<int> requiredLabels;
+    bool orderedRequirements = false;
+    bool rejected = false;
+    
     Image<ImageSpace::Vector,3> *loopcheck = nullptr;
-    Image<bool,3> *visited = nullptr;
     
     std::map<std::string,bool> flags;
     
@@ -29,12 +71,68 @@ private:
     ImageSpace::Vector rightwardsVector;
     float innerProductThreshold = 0.2;
     float stepLength = 0.5;
+    float maxStepLength = 0.0;
     int maxSteps = 2000;
     bool jitter = false;
     bool autoResetRightwardsVector = false;
     
     Logger logger;
     
+    // Apply a function to each record in a metadata image and the
+    // corresponding voxel of the (uncropped) source image
+    template <typename ValueType, class Function>
+    static void updateRecords (Image<VoxelInfo,3,TrackingLayout> &records, const ImageSpace::DimVector &origin, const Image<ValueType,3> &image, Function update)
+    {
+        const ImageRaster<3>::ArrayIndex &dims = records.dim();
+        ImageRaster<3>::ArrayIndex loc, sourceLoc;
+        for (loc[2]=0; loc[2]<dims[2]; loc[2]++)
+        {
+            sourceLoc[2] = loc[2] + origin[2];
+            for (loc[1]=0; loc[1]<dims[1]; loc[1]++)
+            {
+                sourceLoc[1] = loc[1] + origin[1];
+                for (loc[0]=0; loc[0]<dims[0]; loc[0]++)
+                {
+                    sourceLoc[0] = loc[0] + origin[0];
+                    update(records[loc], image[sourceLoc]);
+                }
+            }
+        }
+    }
+    
+    // Apply a function to each voxel record and the corresponding value from
+    // a source image, creating the records if necessary
+    template <typename ValueType, class Function>
+    void updateVoxelInfo (const RNifti::NiftiImage &source, Function update)
+    {
+        if (voxelInfo == nullptr)
+            throw std::runtime_error("The tracking mask must be set before other images");
+        
+        const Image<ValueType,3> image(source);
+        for (int i=0; i<3; i++)
+        {
+            if (image.dim()[i] != static_cast<size_t>(fullDims[i]))
+                throw std::runtime_error("Mask, target and exclusion images must all have the same dimensions");
+        }
+        
+        updateRecords(*voxelInfo, ImageSpace::DimVector {{ 0, 0, 0 }}, image, update);
+        if (croppedVoxelInfo != nullptr)
+            updateRecords(*croppedVoxelInfo, cropOrigin, image, update);
+    }
+    
+    template <class Function>
+    void updateVoxelInfo (Function update)
+    {
+        for (Image<VoxelInfo,3,TrackingLayout> *records : { voxelInfo, croppedVoxelInfo })
+        {
+            if (records != nullptr)
+            {
+                for (VoxelInfo &info : *records)
+                    update(info);
+            }
+        }
+    }
+    
 public:
     // Delete default constructor
     Tracker () = delete;
@@ -44,10 +142,10 @@ public:
     
     ~Tracker ()
     {
-        delete maskData;
-        delete targetData;
+        delete croppedModel;
+        delete voxelInfo;
+        delete croppedVoxelInfo;
         delete loopcheck;
-        delete visited;
     }
     
     DiffusionModel * getModel () const { return model; }
@@ -55,36 +153,69 @@ public:
     ImageSpace::Vector getRightwardsVector () const { return rightwardsVector; }
     float getInnerProductThreshold () const { return innerProductThreshold; }
     float getStepLength () const { return stepLength; }
+    float getMaxStepLength () const { return std::max(stepLength, maxStepLength); }
     
-    void setMask (const RNifti::NiftiImage &mask)
-    {
-        delete maskData;
-        maskData = new Image<short,3>(mask);
-    }
+    // Setting the mask resets the tracker's targets and exclusion region. If
+    // cropping is allowed it is used when the volume saved is worthwhile
+    void setMask (const RNifti::NiftiImage &mask, const bool crop = false);
+    bool isCropped () const { return (croppedModel != nullptr); }
     
-    void setSeed (const ImageSpace::Point &seed, const bool jitter)
+    void setSeed (const ImageSpace::Point &seed, const bool jitter, const bool newSite = true)
     {
-        // An existing rightwards vector needs to be discarded when a new seed is used
+        // An existing rightwards vector needs to be discarded when a new seed
+        // is used, unless it's just a new position within the same seed site
         this->seed = seed;
-        if (autoResetRightwardsVector)
+        if (autoResetRightwardsVector && newSite)
             this->rightwardsVector = ImageSpace::zeroVector();
         this->jitter = jitter;
     }
     
     void setTargets (const RNifti::NiftiImage &targets)
     {
-        delete targetData;
-        targetData = new Image<int,3>(targets);
+        updateVoxelInfo<int>(targets, [](VoxelInfo &info, const int value) { info.target = value; });
+        haveTargets = true;
     }
     
     void clearTargets ()
     {
-        delete targetData;
-        targetData = nullptr;
+        updateVoxelInfo([](VoxelInfo &info) { info.target = 0; });
+        haveTargets = false;
+    }
+    
+    void setExclusion (const RNifti::NiftiImage &exclusion)
+    {
+        updateVoxelInfo<short>(exclusion, [](VoxelInfo &info, const short value) {
+            if (value == 0)
+                info.flags &= ~VoxelInfo::Exclusion;
+            else
+                info.flags |= VoxelInfo::Exclusion;
+        });
+        haveExclusion = true;
+    }
+    
+    void clearExclusion ()
+    {
+        updateVoxelInfo([](VoxelInfo &info) { info.flags &= ~VoxelInfo::Exclusion; });
+        haveExclusion = false;
+    }
+    
+    void setRequirements (const std::vector<int> &labels, const bool ordered)
+    {
+        this->requiredLabels = labels;
+        this->orderedRequirements = ordered;
     }
     
+    bool hasConstraints () const { return (haveExclusion || !requiredLabels.empty()); }
+    
+    // Whether the last streamline generated failed to meet the constraints
+    bool lastRejected () const { return rejected; }
+    
     std::map<int,std::string> & labelDictionary () { return dictionary; }
     
+    // Restore the rightwards vector in use at some earlier point, without
+    // changing whether it is reset for each new seed
+    void restoreRightwardsVector (const ImageSpace::Vector &rightwardsVector) { this->rightwardsVector = rightwardsVector; }
+    
     void setRightwardsVector (const ImageSpace::Vector &rightwardsVector)
     {
         // If the specified rightwards vector is nontrivial, don't clobber it when setting the seed
@@ -94,6 +225,13 @@ public:
     
     void setInnerProductThreshold (const float innerProductThreshold) { this->innerProductThreshold = innerProductThreshold; }
     void setStepLength (const float stepLength) { this->stepLength = stepLength; }
+    
+    // A maximum step length larger than the base length enables adaptive
+    // stepping: while successive sampled directions are coherent, each one
+    // is followed for up to twice as many steps as the last, so the model is
+    // sampled less often in straight sections. Every step is still checked
+    // against the mask, targets and exclusion region, and stored as a point
+    void setMaxStepLength (const float maxStepLength) { this->maxStepLength = maxStepLength; }
     void setMaxSteps (const int maxSteps) { this->maxSteps = maxSteps; }
     
     void setFlag (const std::string &key, const bool value = true) { this->flags[key] = value; }
@@ -104,34 +242,144 @@ public:
     Streamline run ();
 };
 
-class TractographyDataSource : public DataSource<Streamline>
+class TractographyDataSource : public DataSource<Streamline>, public Checkpointable
 {
 private:
     Tracker *tracker;
-    std::vector<ImageSpace::Point> seeds;
+    SeedGenerator *generator;
+    std::vector<int> seedLabels;
     bool jitter;
-    size_t streamlinesPerSeed, totalStreamlines;
+    size_t totalStreamlines;
     size_t currentStreamline = 0, currentSeed = 0;
+    bool rejected = false;
+    
+    // In quota mode, seeds are cycled until the requested number of
+    // streamlines has survived the pipeline's manipulators, or the maximum
+    // number of streamlines has been generated
+    size_t quota = 0, acceptedStreamlines = 0;
+    
+    // Counts from the last complete run, which survive a reset
+    size_t lastGenerated = 0, lastAccepted = 0;
+    
+    // Where the next run should start, if resuming from a checkpoint
+    size_t resumeStreamline = 0, resumeAccepted = 0;
+    
+    // In a sharded run, only streamlines from firstStreamline up to (but not
+    // including) totalStreamlines are generated, and the RNG is reseeded at
+    // the start of each block. R's RNG state from before the run is put back
+    // afterwards
+    size_t firstStreamline = 0;
+    bool sharded = false;
+    uint32_t shardSeed = 0;
+    std::vector<int> savedRandomSeed;
+    
+    // In a sharded run, blocks consist of whole seed sites when sites are
+    // small, and the RNG is also reseeded at the start of each site when
+    // they are large, so the RNG state is always known at the start of a
+    // site. The rightwards vector may be carried between streamlines within
+    // a site, so its state is also known there
+    size_t blockLength () const;
+    bool reseedAt (const size_t n) const;
+    void reseed (const size_t n) const;
+    void saveRandomSeed ();
+    void restoreRandomSeed ();
+    
+    // Regenerate the earlier streamlines from the first seed site of a shard
+    // that starts partway through it, until the rightwards vector is known
+    void primeRightwardsVector ();
+    
+    // A hash of the seed sites and the range of streamlines generated, used
+    // to check that a checkpoint belongs to the same run
+    uint64_t seedHash () const;
     
 public:
     TractographyDataSource (Tracker * const tracker, const std::vector<ImageSpace::Point> &seeds, const size_t streamlinesPerSeed, const bool jitter)
-        : tracker(tracker), seeds(seeds), streamlinesPerSeed(streamlinesPerSeed), jitter(jitter)
+        : TractographyDataSource(tracker, new PointSeedGenerator(seeds,streamlinesPerSeed), jitter) {}
+    
+    // The generator is owned by this object, and jitter is only applied to
+    // seeds that aren't already at subvoxel positions
+    TractographyDataSource (Tracker * const tracker, SeedGenerator * const generator, const bool jitter)
+        : tracker(tracker), generator(generator), jitter(jitter && !generator->subvoxel())
     {
-        this->totalStreamlines = seeds.size() * streamlinesPerSeed;
+        this->totalStreamlines = generator->count();
+    }
+    
+    ~TractographyDataSource ()
+    {
+        delete generator;
     }
     
     Tracker * streamlineTracker () const { return tracker; }
     
+    // Nominal seed locations, one per site
+    std::vector<ImageSpace::Point> getSeeds () const
+    {
+        std::vector<ImageSpace::Point> seeds(generator->sites());
+        for (size_t i=0; i<seeds.size(); i++)
+            seeds[i] = generator->site(i);
+        return seeds;
+    }
+    
+    // Optional region labels for each seed, used for routing streamlines
+    const std::vector<int> & getSeedLabels () const { return seedLabels; }
+    void setSeedLabels (const std::vector<int> &seedLabels)
+    {
+        if (seedLabels.size() != generator->sites())
+            throw std::runtime_error("Seed label vector must have one element per seed");
+        this->seedLabels = seedLabels;
+    }
+    
+    void setQuota (const size_t quota, const size_t maxStreamlines)
+    {
+        if (generator->count() == 0 && quota > 0)
+            throw std::runtime_error("A streamline quota cannot be met without seeds");
+        if (sharded && quota > 0)
+            throw std::runtime_error("A streamline quota cannot be used in a sharded run");
+        this->quota = quota;
+        this->totalStreamlines = (quota > 0 ? maxStreamlines : generator->count());
+    }
+    
+    // Restrict generation to one of nShards contiguous ranges of streamlines,
+    // so that several processes can share the work of one run. Each block's
+    // random choices depend only on the seed and its index, so
+    // concatenating the outputs of all shards gives the same result however
+    // many there are. Sharding can't be combined with a quota
+    void setShard (const size_t index, const size_t nShards, const uint32_t seed);
+    
+    // Statistics from the last run
+    size_t generated () const { return lastGenerated; }
+    size_t accepted () const { return lastAccepted; }
+    double acceptanceRate () const { return (lastGenerated == 0 ? 0.0 : static_cast<double>(lastAccepted) / lastGenerated); }
+    
     std::string type () const override { return "tracker"; }
     
     void setup () override
     {
-        currentStreamline = 0;
+        currentStreamline = std::max(resumeStreamline, firstStreamline);
         currentSeed = 0;
+        acceptedStreamlines = resumeAccepted;
+        resumeStreamline = resumeAccepted = 0;
+        
+        // A resumed run restores the rightwards vector from the checkpoint
+        if (sharded)
+        {
+            saveRandomSeed();
+            if (currentStreamline == firstStreamline)
+                primeRightwardsVector();
+        }
+    }
+    
+    void done () override
+    {
+        lastGenerated = currentStreamline - firstStreamline;
+        lastAccepted = acceptedStreamlines;
+        if (sharded)
+            restoreRandomSeed();
     }
     
-    size_t count () override { return totalStreamlines; }
-    bool more () override { return (currentStreamline < totalStreamlines); }
+    size_t count () override { return (quota > 0 ? quota : totalStreamlines - firstStreamline); }
+    bool more () override { return (currentStreamline < totalStreamlines && (quota == 0 || acceptedStreamlines < quota)); }
+    bool discard () override { return rejected; }
     
     void get (Streamline &data) override
     {
@@ -139,21 +387,29 @@ public:
         if (currentStreamline >= totalStreamlines)
             return;
         
-        // We're moving on to the next seed
-        if (currentStreamline % streamlinesPerSeed == 0)
-        {
-            if (currentStreamline > 0)
-                currentSeed++;
-            
-            tracker->setSeed(seeds[currentSeed], jitter);
-        }
+        // Find the seed, wrapping around in quota mode, and tell the tracker
+        // whether we're moving on to the next seed site
+        const size_t n = currentStreamline % generator->count();
+        if (sharded && reseedAt(n))
+            reseed(n);
+        const ImageSpace::Point seed = generator->seed(n, currentSeed);
+        tracker->setSeed(seed, jitter, n % generator->streamlinesPerSite() == 0);
         
         // Generate the streamline
         data = tracker->run();
+        data.setSeedId(static_cast<int>(currentSeed));
+        rejected = tracker->lastRejected();
         
         // Increment the main counter
         currentStreamline++;
     }
+    
+    size_t preferredBlockSize (const size_t blockSize) override;
+    size_t accept (const size_t n) override;
+    
+    std::string stateTag () const override { return "tracker"; }
+    void saveState (BinaryOutputStream &stream) const override;
+    void restoreState (BinaryInputStream &stream) override;
 };
 
 #endif
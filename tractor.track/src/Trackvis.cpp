@@ -74,7 +74,7 @@ void TrackvisSourceFileAdapter::open (StreamlineFileMetadata &metadata)
             seedProperty = i;
     }
     
-    array<ImageSpace::Element,16> elements;
+    array<RNifti::NiftiImage::Xform::Element,16> elements;
     inputStream->seekg(440, ios::beg);
     inputStream.readArray<float>(elements);
     metadata.space->transform = ImageSpace::Transform(elements.data());
@@ -92,16 +92,32 @@ void TrackvisSourceFileAdapter::read (Streamline &data)
     {
         vector<ImageSpace::Point> points(nPoints);
         int seed = 0;
+        if (nScalars > 0)
+        {
+            for (int32_t i=0; i<nPoints; i++)
+            {
+                inputStream.readPoint<float>(points[i]);
+                inputStream->seekg(4 * nScalars, ios::cur);
+            }
+        }
+        else
+        {
+            // Without interleaved scalars the points can be read in one go
+            vector<float> buffer(3 * nPoints);
+            inputStream.readVector<float>(buffer);
+            for (int32_t i=0; i<nPoints; i++)
+            {
+                for (int j=0; j<3; j++)
+                    points[i][j] = buffer[3*i+j];
+            }
+        }
+        
+        // TrackVis indexes from the left edge of each voxel
+        space->toVoxel(points, PointType::Scaled, RoundingType::None);
         for (int32_t i=0; i<nPoints; i++)
         {
-            inputStream.readPoint<float>(points[i]);
-            
-            // TrackVis indexes from the left edge of each voxel
             for (int j=0; j<3; j++)
-                points[i][j] = points[i][j] / space->pixdim[j] - 0.5;
-            
-            if (nScalars > 0)
-                inputStream->seekg(4 * nScalars, ios::cur);
+                points[i][j] -= 0.5;
         }
         
         if (seedProperty >= 0)
@@ -136,6 +152,7 @@ void TrackvisSourceFileAdapter::skip (const size_t n)
 
 size_t TrackvisSinkFileAdapter::open (const bool append)
 {
+    outputStream.attach(path, append);
     if (append)
     {
         size_t nStreamlines;
@@ -165,22 +182,21 @@ size_t TrackvisSinkFileAdapter::write (const Streamline &data, const ImageSpace
 {
     const size_t offset = outputStream->tellp();
     
-    const size_t nPoints = data.nPoints();
-    std::vector<ImageSpace::Point> points = data.getPoints();
-    
     if (data.imageSpace() == nullptr && space == nullptr)
         throw std::runtime_error("Writing a streamline to TrackVis format requires space information");
     const ImageSpace::PixdimVector &pixdim = (data.imageSpace() == nullptr ? space : data.imageSpace())->pixdim;
     
-    outputStream.writeValue<int32_t>(nPoints);
-    for (size_t i=0; i<nPoints; i++)
-    {
+    // Convert all points into one buffer so that they can be written at once
+    std::vector<float> buffer;
+    buffer.reserve(3 * (data.getLeftPoints().size() + data.getRightPoints().size()));
+    data.visitPoints([&buffer,&pixdim](const ImageSpace::Point &point) {
         // TrackVis indexes from the left edge of each voxel
-        ImageSpace::Point trkPoint = points[i];
         for (int j=0; j<3; j++)
-            trkPoint[j] = (trkPoint[j] + 0.5) * pixdim[j];
-        outputStream.writePoint<float>(trkPoint);
-    }
+            buffer.push_back(static_cast<float>((point[j] + 0.5) * pixdim[j]));
+    });
+    
+    outputStream.writeValue<int32_t>(buffer.size() / 3);
+    outputStream.writeVector<float>(buffer);
     
     // In practice, we should be able to squeeze the seed index into a float, but check
     const size_t seedIndex = data.getSeedIndex();
@@ -65,3 +65,239 @@ void VisitationMapDataSink::done ()
         });
     }
 }
+
+void VisitationMapDataSink::saveState (BinaryOutputStream &stream) const
+{
+    stream.writeValue<uint64_t>(totalStreamlines);
+    stream.writeValue<uint64_t>(values.size());
+    stream.writeVector<double>(values.data());
+}
+
+void VisitationMapDataSink::restoreState (BinaryInputStream &stream)
+{
+    totalStreamlines = stream.readValue<uint64_t,size_t>();
+    if (stream.readValue<uint64_t,size_t>() != values.size())
+        throw std::runtime_error("Visitation map in checkpoint does not match the current image space");
+    
+    std::vector<double> data;
+    stream.readVector<double>(data, values.size());
+    std::copy(data.begin(), data.end(), values.begin());
+}
+
+TrackDensityDataSink::TrackDensityDataSink (ImageSpace *space, const double factor, const WeightingType weighting)
+    : space(space), factor(factor), weighting(weighting)
+{
+    if (space == nullptr)
+        throw std::runtime_error("Track density map cannot be created because the image space is unknown");
+    if (factor < 1.0)
+        throw std::runtime_error("Track density grid cannot be coarser than the native grid");
+    
+    nChannels = (weighting == WeightingType::Direction ? 3 : 1);
+    
+    // Fine voxel k has its centre at native voxel location (k+0.5)/f - 0.5
+    ImageSpace::DimVector dims;
+    ImageSpace::PixdimVector pixdim;
+    ImageSpace::Transform transform = space->transform;
+    const double shift = 0.5 / factor - 0.5;
+    for (int i=0; i<3; i++)
+    {
+        dims[i] = static_cast<int>(ceil(space->dim[i] * factor));
+        pixdim[i] = static_cast<RNifti::NiftiImage::pixdim_t>(space->pixdim[i] / factor);
+        brickCounts[i] = static_cast<int>((dims[i] + brickWidth - 1) / brickWidth);
+    }
+    for (int i=0; i<3; i++)
+    {
+        double offset = 0.0;
+        for (int j=0; j<3; j++)
+        {
+            offset += space->transform(i,j) * shift;
+            transform(i,j) = static_cast<RNifti::NiftiImage::Xform::Element>(space->transform(i,j) / factor);
+        }
+        transform(i,3) = static_cast<RNifti::NiftiImage::Xform::Element>(space->transform(i,3) + offset);
+    }
+    fineSpace = ImageSpace(dims, pixdim, transform);
+}
+
+float * TrackDensityDataSink::voxel (const size_t x, const size_t y, const size_t z)
+{
+    const size_t key = (x / brickWidth) + brickCounts[0] * ((y / brickWidth) + brickCounts[1] * (z / brickWidth));
+    std::vector<float> &brick = bricks[key];
+    if (brick.empty())
+        brick.assign(brickSize * nChannels, 0.0f);
+    const size_t offset = (x % brickWidth) + brickWidth * ((y % brickWidth) + brickWidth * (z % brickWidth));
+    return &brick[offset * nChannels];
+}
+
+void TrackDensityDataSink::put (const Streamline &data)
+{
+    if (!data.hasImageSpace())
+        throw std::runtime_error("Streamline has no image space information");
+    
+    points.clear();
+    data.visitPoints([this](const ImageSpace::Point &point) { points.push_back(point); });
+    space->toVoxel(points, data.getPointType(), RoundingType::None);
+    visited.clear();
+    
+    const ImageSpace::DimVector &dims = fineSpace.dim;
+    auto locate = [&](const double *location, size_t *loc) -> bool {
+        for (int i=0; i<3; i++)
+        {
+            const double fine = floor((location[i] + 0.5) * factor);
+            if (fine < 0.0 || fine >= dims[i])
+                return false;
+            loc[i] = static_cast<size_t>(fine);
+        }
+        return true;
+    };
+    
+    size_t loc[3];
+    if (points.size() == 1)
+    {
+        const double location[3] = { points[0][0], points[0][1], points[0][2] };
+        if (weighting == WeightingType::Count && locate(location, loc))
+            voxel(loc[0], loc[1], loc[2])[0] += 1.0f;
+        return;
+    }
+    
+    // Each segment is divided into substeps of at most half a fine voxel,
+    // and each substep is attributed to the fine voxel containing its midpoint
+    for (size_t k=1; k<points.size(); k++)
+    {
+        double step[3], length = 0.0, fineLength = 0.0;
+        for (int i=0; i<3; i++)
+        {
+            step[i] = points[k][i] - points[k-1][i];
+            length += step[i] * step[i] * space->pixdim[i] * space->pixdim[i];
+            fineLength = std::max(fineLength, fabs(step[i]) * factor);
+        }
+        length = sqrt(length);
+        if (length == 0.0)
+            continue;
+        
+        const int nSubsteps = std::max(1, static_cast<int>(ceil(2.0 * fineLength)));
+        const double substepLength = length / nSubsteps;
+        for (int s=0; s<nSubsteps; s++)
+        {
+            const double fraction = (s + 0.5) / nSubsteps;
+            const double location[3] = { points[k-1][0] + fraction * step[0], points[k-1][1] + fraction * step[1], points[k-1][2] + fraction * step[2] };
+            if (!locate(location, loc))
+                continue;
+            
+            if (weighting == WeightingType::Count)
+                visited.push_back(loc[0] + dims[0] * (loc[1] + dims[1] * loc[2]));
+            else
+            {
+                float *values = voxel(loc[0], loc[1], loc[2]);
+                if (weighting == WeightingType::Length)
+                    values[0] += static_cast<float>(substepLength);
+                else
+                {
+                    for (int i=0; i<3; i++)
+                        values[i] += static_cast<float>(fabs(step[i] * space->pixdim[i]) / length * substepLength);
+                }
+            }
+        }
+    }
+    
+    // Each streamline is only counted once per voxel
+    if (weighting == WeightingType::Count)
+    {
+        std::sort(visited.begin(), visited.end());
+        visited.erase(std::unique(visited.begin(), visited.end()), visited.end());
+        for (const size_t &index : visited)
+        {
+            const size_t x = index % dims[0];
+            const size_t y = (index / dims[0]) % dims[1];
+            const size_t z = index / (static_cast<size_t>(dims[0]) * dims[1]);
+            voxel(x, y, z)[0] += 1.0f;
+        }
+    }
+}
+
+void TrackDensityDataSink::merge (const TrackDensityDataSink &other)
+{
+    if (other.fineSpace.dim != fineSpace.dim || other.nChannels != nChannels)
+        throw std::runtime_error("Track density maps do not have the same geometry");
+    
+    for (auto it=other.bricks.cbegin(); it!=other.bricks.cend(); it++)
+    {
+        std::vector<float> &brick = bricks[it->first];
+        if (brick.empty())
+            brick = it->second;
+        else
+            std::transform(brick.begin(), brick.end(), it->second.begin(), brick.begin(), std::plus<float>());
+    }
+}
+
+void TrackDensityDataSink::getElements (std::vector<double> &indices, std::vector<std::vector<double>> &values) const
+{
+    const ImageSpace::DimVector &dims = fineSpace.dim;
+    
+    // Visit bricks in index order, so that the result is sorted
+    std::vector<size_t> keys;
+    for (auto it=bricks.cbegin(); it!=bricks.cend(); it++)
+        keys.push_back(it->first);
+    std::sort(keys.begin(), keys.end());
+    
+    std::vector<std::pair<double,size_t>> elements;
+    std::vector<const float *> sources;
+    for (const size_t &key : keys)
+    {
+        const std::vector<float> &brick = bricks.at(key);
+        const size_t bx = key % brickCounts[0], by = (key / brickCounts[0]) % brickCounts[1], bz = key / (static_cast<size_t>(brickCounts[0]) * brickCounts[1]);
+        for (size_t offset=0; offset<brickSize; offset++)
+        {
+            const float *voxelValues = &brick[offset * nChannels];
+            bool nonzero = false;
+            for (int c=0; c<nChannels; c++)
+                nonzero = nonzero || (voxelValues[c] != 0.0f);
+            if (!nonzero)
+                continue;
+            
+            const size_t x = bx * brickWidth + offset % brickWidth;
+            const size_t y = by * brickWidth + (offset / brickWidth) % brickWidth;
+            const size_t z = bz * brickWidth + offset / (brickWidth * brickWidth);
+            elements.push_back(std::make_pair(static_cast<double>(x + dims[0] * (y + static_cast<size_t>(dims[1]) * z)), sources.size()));
+            sources.push_back(voxelValues);
+        }
+    }
+    std::sort(elements.begin(), elements.end());
+    
+    indices.resize(elements.size());
+    values.assign(nChannels, std::vector<double>(elements.size()));
+    for (size_t i=0; i<elements.size(); i++)
+    {
+        indices[i] = elements[i].first;
+        for (int c=0; c<nChannels; c++)
+            values[c][i] = static_cast<double>(sources[elements[i].second][c]);
+    }
+}
+
+RNifti::NiftiImage TrackDensityDataSink::toNifti () const
+{
+    std::vector<double> indices;
+    std::vector<std::vector<double>> values;
+    getElements(indices, values);
+    
+    const size_t volumeSize = static_cast<size_t>(fineSpace.dim[0]) * fineSpace.dim[1] * fineSpace.dim[2];
+    if (nChannels == 1)
+    {
+        Image<float,3> image(fineSpace.dim, 0.0f);
+        image.setImageSpace(new ImageSpace(fineSpace));
+        for (size_t i=0; i<indices.size(); i++)
+            image[static_cast<size_t>(indices[i])] = static_cast<float>(values[0][i]);
+        return image.toNifti(DT_FLOAT32);
+    }
+    else
+    {
+        Image<float,4>::ArrayIndex dims = {{ static_cast<size_t>(fineSpace.dim[0]), static_cast<size_t>(fineSpace.dim[1]), static_cast<size_t>(fineSpace.dim[2]), static_cast<size_t>(nChannels) }};
+        Image<float,4> image(dims, 0.0f);
+        image.setImageSpace(new ImageSpace(fineSpace));
+        for (size_t i=0; i<indices.size(); i++)
+        {
+            for (int c=0; c<nChannels; c++)
+                image[static_cast<size_t>(indices[i]) + c * volumeSize] = static_cast<float>(values[c][i]);
+        }
+        return image.toNifti(DT_FLOAT32);
+    }
+}
@@ -4,8 +4,11 @@
 #include "DataSource.h"
 #include "Streamline.h"
 #include "Image.h"
+#include "Checkpoint.h"
 
-class VisitationMapDataSink : public DataSink<Streamline>
+#include <unordered_map>
+
+class VisitationMapDataSink : public DataSink<Streamline>, public Checkpointable
 {
 public:
     enum struct MappingScope { All, Seed, Ends };
@@ -35,7 +38,68 @@ public:
     void put (const Streamline &data) override;
     void done () override;
     
+    std::string stateTag () const override { return "map"; }
+    void saveState (BinaryOutputStream &stream) const override;
+    void restoreState (BinaryInputStream &stream) override;
+    
     const Image<double,3> & getImage () const { return values; }
 };
 
+// Track density imaging, optionally on a grid finer than the native one by
+// some factor. Each streamline contributes to every fine voxel it passes
+// through, by a count (once per streamline), the length within the voxel
+// (in real-world units), or the length-weighted absolute direction (three
+// channels, for directionally-encoded colour). The grid is held sparsely, as
+// bricks of 8x8x8 voxels allocated when first touched, so only the volume
+// near streamlines uses memory
+class TrackDensityDataSink : public DataSink<Streamline>
+{
+public:
+    enum struct WeightingType { Count, Length, Direction };
+
+private:
+    static const size_t brickWidth = 8;
+    static const size_t brickSize = brickWidth * brickWidth * brickWidth;
+    
+    ImageSpace *space;
+    ImageSpace fineSpace;
+    double factor;
+    WeightingType weighting;
+    int nChannels;
+    
+    ImageSpace::DimVector brickCounts;
+    std::unordered_map<size_t,std::vector<float>> bricks;
+    
+    // Working storage
+    std::vector<ImageSpace::Point> points;
+    std::vector<size_t> visited;
+    
+    // Returns a pointer to the channel values for the fine voxel at the
+    // specified location, allocating its brick if necessary
+    float * voxel (const size_t x, const size_t y, const size_t z);
+    
+public:
+    // Delete the default constructor
+    TrackDensityDataSink () = delete;
+    
+    TrackDensityDataSink (ImageSpace *space, const double factor = 1.0, const WeightingType weighting = WeightingType::Count);
+    
+    void put (const Streamline &data) override;
+    
+    // Adds the contents of another sink with the same geometry, so that
+    // subsets of streamlines can be mapped separately and combined
+    void merge (const TrackDensityDataSink &other);
+    
+    const ImageSpace & imageSpace () const { return fineSpace; }
+    int channels () const { return nChannels; }
+    size_t nBricks () const { return bricks.size(); }
+    
+    // Nonzero voxels as zero-based linear indices into the fine grid, with
+    // their values, channel by channel
+    void getElements (std::vector<double> &indices, std::vector<std::vector<double>> &values) const;
+    
+    // The full grid, as a 3D image or, for direction weighting, a 4D one
+    RNifti::NiftiImage toNifti () const;
+};
+
 #endif
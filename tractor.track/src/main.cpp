@@ -9,10 +9,18 @@
 #include "Files.h"
 #include "VisitationMap.h"
 #include "RCallback.h"
+#include "Routing.h"
+#include "Cluster.h"
+#include "Distance.h"
+#include "Profile.h"
+#include "Connectivity.h"
 #include "Pipeline.h"
+#include "Checkpoint.h"
 
 #include <Rcpp.h>
 
+#include <memory>
+
 using namespace Rcpp;
 
 typedef std::vector<std::string> str_vector;
@@ -38,7 +46,7 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP createTracker (SEXP _model, SEXP _mask, SEXP _maxSteps, SEXP _stepLength, SEXP _curvatureThreshold, SEXP _useLoopcheck, SEXP _oneWay)
+RcppExport SEXP createTracker (SEXP _model, SEXP _mask, SEXP _maxSteps, SEXP _stepLength, SEXP _curvatureThreshold, SEXP _useLoopcheck, SEXP _oneWay, SEXP _crop, SEXP _maxStepLength)
 {
 BEGIN_RCPP
     XPtr<DiffusionModel> modelPtr(_model);
@@ -49,7 +57,7 @@ BEGIN_RCPP
     
     RNifti::NiftiImage mask(_mask);
     mask.reorient(space->orientation());
-    tracker->setMask(mask);
+    tracker->setMask(mask, as<bool>(_crop));
     
     std::map<std::string,bool> flags;
     flags["loopcheck"] = as<bool>(_useLoopcheck);
@@ -58,6 +66,8 @@ BEGIN_RCPP
     
     tracker->setInnerProductThreshold(as<float>(_curvatureThreshold));
     tracker->setStepLength(as<float>(_stepLength));
+    if (!Rf_isNull(_maxStepLength))
+        tracker->setMaxStepLength(as<float>(_maxStepLength));
     tracker->setMaxSteps(as<int>(_maxSteps));
     
     return XPtr<Tracker>(tracker);
@@ -97,12 +107,32 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP initialiseTracker (SEXP _tracker, SEXP _seeds, SEXP _count, SEXP _rightwardsVector, SEXP _jitter)
+RcppExport SEXP setTrackerConstraints (SEXP _tracker, SEXP _exclusion, SEXP _requiredLabels, SEXP _ordered)
 {
 BEGIN_RCPP
     XPtr<Tracker> trackerPtr(_tracker);
     Tracker *tracker = trackerPtr;
+    ImageSpace *space = tracker->getModel()->imageSpace();
+    
+    if (Rf_isNull(_exclusion))
+        tracker->clearExclusion();
+    else
+    {
+        RNifti::NiftiImage exclusionImage(_exclusion);
+        tracker->setExclusion(exclusionImage.reorient(space->orientation()));
+    }
+    
+    if (Rf_isNull(_requiredLabels))
+        tracker->setRequirements(std::vector<int>(), false);
+    else
+        tracker->setRequirements(as<std::vector<int>>(_requiredLabels), as<bool>(_ordered));
     
+    return R_NilValue;
+END_RCPP
+}
+
+static void setRightwardsVector (Tracker *tracker, SEXP _rightwardsVector)
+{
     ImageSpace::Vector rightwardsVector = ImageSpace::zeroVector();
     if (!Rf_isNull(_rightwardsVector))
     {
@@ -113,6 +143,14 @@ BEGIN_RCPP
             rightwardsVector[i] = rightwardsVectorR[i];
     }
     tracker->setRightwardsVector(rightwardsVector);
+}
+
+RcppExport SEXP initialiseTracker (SEXP _tracker, SEXP _seeds, SEXP _count, SEXP _rightwardsVector, SEXP _jitter, SEXP _seedLabels, SEXP _quota, SEXP _maxCount, SEXP _spatialOrder)
+{
+BEGIN_RCPP
+    XPtr<Tracker> trackerPtr(_tracker);
+    Tracker *tracker = trackerPtr;
+    setRightwardsVector(tracker, _rightwardsVector);
     
     NumericMatrix seedsR(_seeds);
     if (seedsR.ncol() != 3)
@@ -126,12 +164,83 @@ BEGIN_RCPP
         seeds.push_back(seed);
     }
     
-    DataSource<Streamline> *source = new TractographyDataSource(tracker, seeds, as<size_t>(_count), as<bool>(_jitter));
+    SeedGenerator *generator = new PointSeedGenerator(seeds, as<size_t>(_count));
+    if (as<bool>(_spatialOrder))
+        generator = new SpatiallyOrderedSeedGenerator(generator);
+    
+    TractographyDataSource *source = new TractographyDataSource(tracker, generator, as<bool>(_jitter));
+    if (!Rf_isNull(_seedLabels))
+        source->setSeedLabels(as<std::vector<int>>(_seedLabels));
+    if (!Rf_isNull(_quota))
+        source->setQuota(as<size_t>(_quota), as<size_t>(_maxCount));
+    
     Pipeline<Streamline> *pipeline = new Pipeline<Streamline>(source);
     return XPtr<Pipeline<Streamline>>(pipeline);
 END_RCPP
 }
 
+RcppExport SEXP initialiseMaskTracker (SEXP _tracker, SEXP _mask, SEXP _mode, SEXP _count, SEXP _rightwardsVector, SEXP _jitter, SEXP _quota, SEXP _maxCount, SEXP _spatialOrder)
+{
+BEGIN_RCPP
+    XPtr<Tracker> trackerPtr(_tracker);
+    Tracker *tracker = trackerPtr;
+    ImageSpace *space = tracker->getModel()->imageSpace();
+    setRightwardsVector(tracker, _rightwardsVector);
+    
+    const MaskSeedGenerator::Mode mode = std::unordered_map<std::string,MaskSeedGenerator::Mode>({
+        { "voxel",      MaskSeedGenerator::Mode::Voxel },
+        { "stratified", MaskSeedGenerator::Mode::Stratified },
+        { "random",     MaskSeedGenerator::Mode::Random }
+    }).at(as<std::string>(_mode));
+    
+    // Seeds are generated within the tracker, so the mask must be in the same orientation as the model
+    RNifti::NiftiImage maskImage(_mask);
+    maskImage.reorient(space->orientation());
+    Image<short,3> mask(maskImage);
+    
+    SeedGenerator *generator = new MaskSeedGenerator(mask, mode, as<size_t>(_count));
+    if (as<bool>(_spatialOrder))
+        generator = new SpatiallyOrderedSeedGenerator(generator);
+    
+    TractographyDataSource *source = new TractographyDataSource(tracker, generator, as<bool>(_jitter));
+    if (!Rf_isNull(_quota))
+        source->setQuota(as<size_t>(_quota), as<size_t>(_maxCount));
+    
+    Pipeline<Streamline> *pipeline = new Pipeline<Streamline>(source);
+    return List::create(_["pointer"]=XPtr<Pipeline<Streamline>>(pipeline), _["count"]=static_cast<double>(source->count()));
+END_RCPP
+}
+
+RcppExport SEXP setTrackerShard (SEXP _pipeline, SEXP _index, SEXP _count, SEXP _seed)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    if (pipeline->dataSource()->type() != "tracker")
+        throw Rcpp::exception("Only a tracker source can be sharded");
+    
+    // The shard index is one-based in R
+    const int index = as<int>(_index);
+    if (index < 1)
+        throw Rcpp::exception("Shard index should be positive");
+    
+    TractographyDataSource *source = static_cast<TractographyDataSource *>(pipeline->dataSource());
+    source->setShard(static_cast<size_t>(index - 1), as<size_t>(_count), static_cast<uint32_t>(as<int>(_seed)));
+    return wrap(static_cast<double>(source->count()));
+END_RCPP
+}
+
+RcppExport SEXP getTrackingStatistics (SEXP _pipeline)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    if (pipeline->dataSource()->type() != "tracker")
+        throw Rcpp::exception("Tracking statistics are only available for a tracker source");
+    
+    TractographyDataSource *source = static_cast<TractographyDataSource *>(pipeline->dataSource());
+    return List::create(_["generated"]=static_cast<double>(source->generated()), _["accepted"]=static_cast<double>(source->accepted()), _["rate"]=source->acceptanceRate());
+END_RCPP
+}
+
 RcppExport SEXP trkOpen (SEXP _path, SEXP _readLabels)
 {
 BEGIN_RCPP
@@ -149,6 +258,14 @@ BEGIN_RCPP
 END_RCPP
 }
 
+RcppExport SEXP trkMerge (SEXP _paths, SEXP _outputPath)
+{
+BEGIN_RCPP
+    const size_t count = concatenateStreamlineFiles(as<std::vector<std::string>>(_paths), as<std::string>(_outputPath));
+    return wrap(static_cast<double>(count));
+END_RCPP
+}
+
 RcppExport SEXP createListSource (SEXP _list)
 {
 BEGIN_RCPP
@@ -158,7 +275,16 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP setFilters (SEXP _pipeline, SEXP _minLabels, SEXP _maxLabels, SEXP _minLength, SEXP _maxLength, SEXP _medianOnly, SEXP _medianQuantileLength)
+RcppExport SEXP createColumnarSource (SEXP _columns)
+{
+BEGIN_RCPP
+    RColumnarDataSource *source = new RColumnarDataSource(_columns);
+    Pipeline<Streamline> *pipeline = new Pipeline<Streamline>(source);
+    return XPtr<Pipeline<Streamline>>(pipeline);
+END_RCPP
+}
+
+RcppExport SEXP setFilters (SEXP _pipeline, SEXP _minLabels, SEXP _maxLabels, SEXP _minLength, SEXP _maxLength, SEXP _medianOnly, SEXP _medianQuantileLength, SEXP _medianApproximate)
 {
 BEGIN_RCPP
     Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
@@ -176,7 +302,12 @@ BEGIN_RCPP
     if (minLength > 0.0 || maxLength > 0.0)
         pipeline->addManipulator(new LengthFilter(minLength, maxLength));
     
-    if (as<bool>(_medianOnly))
+    if (as<bool>(_medianOnly) && as<bool>(_medianApproximate))
+    {
+        // The streaming median works blockwise, so the block size can stay as it is
+        pipeline->addManipulator(new StreamingMedianStreamlineFilter(as<double>(_medianQuantileLength)));
+    }
+    else if (as<bool>(_medianOnly))
     {
         pipeline->addManipulator(new MedianStreamlineFilter(as<double>(_medianQuantileLength)));
         
@@ -190,7 +321,93 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP runPipeline (SEXP _pipeline, SEXP _selection, SEXP _path, SEXP _requireStreamlines, SEXP _requireMap, SEXP _mapScope, SEXP _normaliseMap, SEXP _requireProfile, SEXP _requireLengths, SEXP _leftLength, SEXP _rightLength, SEXP _refImage, SEXP _debugLevel, SEXP _streamlineFun)
+// The sinks needed to produce the outputs requested from a pipeline run
+struct PipelineOutputs
+{
+    std::vector<DataSink<Streamline>*> sinks;
+    StreamlineFileSink *file = nullptr;
+    RColumnarDataSink *list = nullptr;
+    VisitationMapDataSink *visitationMap = nullptr;
+    LabelProfileDataSink *profile = nullptr;
+    StreamlineLengthsDataSink *lengths = nullptr;
+};
+
+// Resampling and simplification (if the spacing or tolerance is positive) are
+// only applied to the streamlines that are written out or returned
+static PipelineOutputs createOutputs (std::map<std::string,bool> &requirements, const std::string &path, ImageSpace *space, Tracker *tracker, const std::string &scopeString, const bool normaliseMap, const double spacing, const double tolerance, const bool append = false)
+{
+    PipelineOutputs outputs;
+    const bool resample = (spacing > 0.0 || tolerance > 0.0);
+    
+    if (requirements["map"] && space == nullptr)
+        throw Rcpp::exception("Visitation map cannot be created because the image space is unknown");
+    
+    if (requirements["file"])
+    {
+        outputs.file = new StreamlineFileSink(path, true, append);
+        outputs.file->setImageSpace(space);
+        if (tracker != nullptr)
+            outputs.file->labelDictionary() = tracker->labelDictionary();
+        if (resample)
+            outputs.sinks.push_back(new ResamplingDataSink(outputs.file, spacing, tolerance));
+        else
+            outputs.sinks.push_back(outputs.file);
+    }
+    
+    if (requirements["list"])
+    {
+        outputs.list = new RColumnarDataSink;
+        if (resample)
+            outputs.sinks.push_back(new ResamplingDataSink(outputs.list, spacing, tolerance));
+        else
+            outputs.sinks.push_back(outputs.list);
+    }
+    
+    if (requirements["map"])
+    {
+        VisitationMapDataSink::MappingScope scope = VisitationMapDataSink::MappingScope::All;
+        if (scopeString == "seed")
+            scope = VisitationMapDataSink::MappingScope::Seed;
+        else if (scopeString == "ends")
+            scope = VisitationMapDataSink::MappingScope::Ends;
+        
+        outputs.visitationMap = new VisitationMapDataSink(space, scope, normaliseMap);
+        outputs.sinks.push_back(outputs.visitationMap);
+    }
+    
+    if (requirements["profile"])
+    {
+        outputs.profile = new LabelProfileDataSink;
+        outputs.sinks.push_back(outputs.profile);
+    }
+    
+    if (requirements["lengths"])
+    {
+        outputs.lengths = new StreamlineLengthsDataSink;
+        outputs.sinks.push_back(outputs.lengths);
+    }
+    
+    return outputs;
+}
+
+static List getResults (const PipelineOutputs &outputs, const size_t count)
+{
+    List result;
+    result["count"] = count;
+    
+    if (outputs.visitationMap != nullptr)
+        result["map"] = outputs.visitationMap->getImage().toNifti(DT_FLOAT64).toPointer("visitation map");
+    if (outputs.list != nullptr)
+        result["streamlines"] = outputs.list->getList();
+    if (outputs.profile != nullptr)
+        result["profile"] = outputs.profile->getProfile();
+    if (outputs.lengths != nullptr)
+        result["lengths"] = outputs.lengths->getLengths();
+    
+    return result;
+}
+
+RcppExport SEXP runPipeline (SEXP _pipeline, SEXP _selection, SEXP _path, SEXP _requireStreamlines, SEXP _requireMap, SEXP _mapScope, SEXP _normaliseMap, SEXP _requireProfile, SEXP _requireLengths, SEXP _leftLength, SEXP _rightLength, SEXP _resampleSpacing, SEXP _simplifyTolerance, SEXP _refImage, SEXP _checkpoint, SEXP _checkpointInterval, SEXP _debugLevel)
 {
 BEGIN_RCPP
     Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
@@ -210,6 +427,8 @@ BEGIN_RCPP
         space = static_cast<StreamlineFileSource *>(pipeline->dataSource())->imageSpace();
     else if (sourceType == "list")
         space = static_cast<RListDataSource *>(pipeline->dataSource())->imageSpace();
+    else if (sourceType == "columnar")
+        space = static_cast<RColumnarDataSource *>(pipeline->dataSource())->imageSpace();
     
     if (!Rf_isNull(_refImage) && space == nullptr)
     {
@@ -222,6 +441,8 @@ BEGIN_RCPP
     
     if (!Rf_isNull(_leftLength) || !Rf_isNull(_rightLength))
         pipeline->addManipulator(new StreamlineTruncator(as<double>(_leftLength), as<double>(_rightLength)));
+    const double spacing = (Rf_isNull(_resampleSpacing) ? 0.0 : as<double>(_resampleSpacing));
+    const double tolerance = (Rf_isNull(_simplifyTolerance) ? 0.0 : as<double>(_simplifyTolerance));
     
     std::map<std::string,bool> requirements;
     requirements["file"] = as<bool>(_requireStreamlines) && !path.empty();
@@ -230,70 +451,50 @@ BEGIN_RCPP
     requirements["profile"] = as<bool>(_requireProfile);
     requirements["lengths"] = as<bool>(_requireLengths);
     
-    // For jitter and probabilistic interpolation
-    RNGScope rng;
-    
-    if (requirements["file"])
-    {
-        StreamlineFileSink *trkFile = new StreamlineFileSink(path);
-        trkFile->setImageSpace(space);
-        if (tracker != nullptr)
-            trkFile->labelDictionary() = tracker->labelDictionary();
-        pipeline->addSink(trkFile);
-    }
-    
-    RListDataSink *list = nullptr;
-    if (requirements["list"])
+    // Checkpoints can only capture outputs that are accumulated in C++ and
+    // reproducible from the source's position and the RNG state. If one
+    // already exists, the run picks up from it
+    const std::string checkpointPath = (Rf_isNull(_checkpoint) ? "" : as<std::string>(_checkpoint));
+    const bool resuming = (!checkpointPath.empty() && CheckpointDataSink::exists(checkpointPath));
+    if (!checkpointPath.empty())
     {
-        list = new RListDataSink(_streamlineFun);
-        pipeline->addSink(list);
+        if (tracker == nullptr)
+            throw Rcpp::exception("Checkpoints can only be used when tracking");
+        if (requirements["list"] || requirements["lengths"])
+            throw Rcpp::exception("Checkpoints cannot be used when streamlines or lengths are returned to R");
     }
     
-    VisitationMapDataSink *visitationMap = nullptr;
-    if (requirements["map"])
-    {
-        if (space == nullptr)
-            throw Rcpp::exception("Visitation map cannot be created because the image space is unknown");
-        
-        const std::string scopeString = as<std::string>(_mapScope);
-        VisitationMapDataSink::MappingScope scope = VisitationMapDataSink::MappingScope::All;
-        if (scopeString == "seed")
-            scope = VisitationMapDataSink::MappingScope::Seed;
-        else if (scopeString == "ends")
-            scope = VisitationMapDataSink::MappingScope::Ends;
-        
-        visitationMap = new VisitationMapDataSink(space, scope, as<bool>(_normaliseMap));
-        pipeline->addSink(visitationMap);
-    }
+    // For jitter and probabilistic interpolation
+    RNGScope rng;
     
-    LabelProfileDataSink *profile = nullptr;
-    if (requirements["profile"])
-    {
-        profile = new LabelProfileDataSink;
-        pipeline->addSink(profile);
-    }
+    PipelineOutputs outputs = createOutputs(requirements, path, space, tracker, as<std::string>(_mapScope), as<bool>(_normaliseMap), spacing, tolerance, resuming);
+    for (DataSink<Streamline> *sink : outputs.sinks)
+        pipeline->addSink(sink);
     
-    StreamlineLengthsDataSink *lengths = nullptr;
-    if (requirements["lengths"])
+    CheckpointDataSink *checkpoint = nullptr;
+    if (!checkpointPath.empty())
     {
-        lengths = new StreamlineLengthsDataSink;
-        pipeline->addSink(lengths);
+        std::vector<Checkpointable*> components;
+        components.push_back(static_cast<TractographyDataSource *>(pipeline->dataSource()));
+        if (outputs.file != nullptr)
+            components.push_back(outputs.file);
+        if (outputs.visitationMap != nullptr)
+            components.push_back(outputs.visitationMap);
+        if (outputs.profile != nullptr)
+            components.push_back(outputs.profile);
+        
+        // This has to be the last sink
+        checkpoint = new CheckpointDataSink(checkpointPath, as<size_t>(_checkpointInterval), components);
+        pipeline->addSink(checkpoint);
+        if (resuming)
+            checkpoint->restore();
     }
     
     // Run the pipeline, storing outputs in files and/or sink objects
-    const size_t count = pipeline->run();
-    
-    List result;
-    result["count"] = count;
-    
-    if (requirements["map"])
-        result["map"] = visitationMap->getImage().toNifti(DT_FLOAT64).toPointer("visitation map");
-    if (requirements["list"])
-        result["streamlines"] = list->getList();
-    if (requirements["profile"])
-        result["profile"] = profile->getProfile();
-    if (requirements["lengths"])
-        result["lengths"] = lengths->getLengths();
+    size_t count = pipeline->run();
+    if (checkpoint != nullptr)
+        count += checkpoint->resumed();
+    List result = getResults(outputs, count);
     
     // Reset the source and clear all sinks and manipulators
     pipeline->reset();
@@ -305,6 +506,70 @@ BEGIN_RCPP
 END_RCPP
 }
 
+RcppExport SEXP runRegionPipeline (SEXP _pipeline, SEXP _labels, SEXP _paths, SEXP _requireStreamlines, SEXP _requireMap, SEXP _mapScope, SEXP _normaliseMap, SEXP _requireProfile, SEXP _requireLengths, SEXP _resampleSpacing, SEXP _simplifyTolerance, SEXP _debugLevel)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    if (pipeline->dataSource()->type() != "tracker")
+        throw Rcpp::exception("Regionwise processing requires a tracker source");
+    
+    TractographyDataSource *source = static_cast<TractographyDataSource *>(pipeline->dataSource());
+    if (source->getSeedLabels().empty())
+        throw Rcpp::exception("Seed labels have not been specified");
+    
+    Tracker *tracker = source->streamlineTracker();
+    tracker->setDebugLevel(as<int>(_debugLevel));
+    ImageSpace *space = tracker->getModel()->imageSpace();
+    
+    const std::vector<int> labels = as<std::vector<int>>(_labels);
+    const std::vector<std::string> paths = as<std::vector<std::string>>(_paths);
+    if (labels.size() != paths.size())
+        throw Rcpp::exception("There should be one path per region label");
+    
+    const double spacing = (Rf_isNull(_resampleSpacing) ? 0.0 : as<double>(_resampleSpacing));
+    const double tolerance = (Rf_isNull(_simplifyTolerance) ? 0.0 : as<double>(_simplifyTolerance));
+    
+    // All regions share one tracking run, with each streamline passed to the
+    // outputs for the region containing its seed
+    RoutingDataSink *router = new RoutingDataSink(source->getSeedLabels());
+    std::vector<PipelineOutputs> outputs;
+    for (size_t i=0; i<labels.size(); i++)
+    {
+        std::map<std::string,bool> requirements;
+        requirements["file"] = as<bool>(_requireStreamlines) && !paths[i].empty();
+        requirements["list"] = as<bool>(_requireStreamlines) && paths[i].empty();
+        requirements["map"] = as<bool>(_requireMap);
+        requirements["profile"] = as<bool>(_requireProfile);
+        requirements["lengths"] = as<bool>(_requireLengths);
+        
+        outputs.push_back(createOutputs(requirements, paths[i], space, tracker, as<std::string>(_mapScope), as<bool>(_normaliseMap), spacing, tolerance));
+        for (DataSink<Streamline> *sink : outputs.back().sinks)
+            router->addSink(labels[i], sink);
+    }
+    pipeline->addSink(router);
+    
+    // For jitter and probabilistic interpolation
+    RNGScope rng;
+    pipeline->run();
+    
+    List results(labels.size());
+    for (size_t i=0; i<labels.size(); i++)
+        results[i] = getResults(outputs[i], router->count(labels[i]));
+    
+    pipeline->reset();
+    return results;
+END_RCPP
+}
+
+RcppExport SEXP resetPipeline (SEXP _pipeline)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    pipeline->reset();
+    return R_NilValue;
+END_RCPP
+}
+
 RcppExport SEXP trkFind (SEXP _pipeline, SEXP _labels, SEXP _map, SEXP _combine)
 {
 BEGIN_RCPP
@@ -364,3 +629,314 @@ BEGIN_RCPP
     return wrap(indices);
 END_RCPP
 }
+
+RcppExport SEXP clusterStreamlines (SEXP _pipeline, SEXP _selection, SEXP _threshold, SEXP _nPoints)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    pipeline->setSubset(_selection);
+    
+    StreamlineClusterDataSink *clusterer = new StreamlineClusterDataSink(as<double>(_threshold), as<size_t>(_nPoints));
+    pipeline->addSink(clusterer);
+    
+    // For jitter and probabilistic interpolation, if the source is a tracker
+    RNGScope rng;
+    pipeline->run();
+    
+    RColumnarDataSink centroids;
+    for (const Streamline &centroid : clusterer->getCentroids())
+        centroids.put(centroid);
+    
+    // R indices are one-based
+    std::vector<int> membership = clusterer->getMembership();
+    std::transform(membership.begin(), membership.end(), membership.begin(), [](const int x) { return x+1; });
+    
+    List result = List::create(_["centroids"]=centroids.getList(), _["sizes"]=clusterer->getSizes(), _["membership"]=membership);
+    
+    // The pipeline deletes the sink
+    pipeline->reset();
+    
+    return result;
+END_RCPP
+}
+
+RcppExport SEXP streamlineDistances (SEXP _pipeline, SEXP _selection, SEXP _otherPipeline, SEXP _otherSelection, SEXP _metric, SEXP _nPoints, SEXP _threshold, SEXP _k, SEXP _nThreads)
+{
+BEGIN_RCPP
+    const DistanceMetric metric = std::unordered_map<std::string,DistanceMetric>({
+        { "mdf",        DistanceMetric::MDF },
+        { "mam",        DistanceMetric::MAM },
+        { "hausdorff",  DistanceMetric::Hausdorff }
+    }).at(as<std::string>(_metric));
+    
+    // Resample the streamlines from each source; the sinks are owned by the
+    // pipelines, so they are not reset until the calculation is done
+    RNGScope rng;
+    const size_t nPoints = as<size_t>(_nPoints);
+    
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    ResampledStreamlineDataSink *first = new ResampledStreamlineDataSink(nPoints);
+    pipeline->setSubset(_selection);
+    pipeline->addSink(first);
+    pipeline->run();
+    
+    Pipeline<Streamline> *otherPipeline = nullptr;
+    ResampledStreamlineDataSink *second = first;
+    if (!Rf_isNull(_otherPipeline))
+    {
+        otherPipeline = XPtr<Pipeline<Streamline>>(_otherPipeline).checked_get();
+        second = new ResampledStreamlineDataSink(nPoints);
+        otherPipeline->setSubset(_otherSelection);
+        otherPipeline->addSink(second);
+        otherPipeline->run();
+    }
+    
+    const size_t limit = static_cast<size_t>(std::numeric_limits<int>::max());
+    if (first->size() > limit || second->size() > limit)
+        throw Rcpp::exception("Too many streamlines to index");
+    
+    StreamlineDistanceCalculator calculator(metric, as<size_t>(_nThreads));
+    
+    // R indices are one-based
+    auto toR = [](std::vector<int> &indices) {
+        std::transform(indices.begin(), indices.end(), indices.begin(), [](const int x) { return x < 0 ? NA_INTEGER : x+1; });
+    };
+    
+    RObject result;
+    if (!Rf_isNull(_k))
+    {
+        const size_t k = as<size_t>(_k);
+        std::vector<int> indices;
+        std::vector<double> distances;
+        calculator.nearest(*first, *second, k, indices, distances);
+        toR(indices);
+        
+        // The calculator's arrays are row-major, so transpose for R
+        IntegerMatrix indicesR(first->size(), k);
+        NumericMatrix distancesR(first->size(), k);
+        for (size_t i=0; i<first->size(); i++)
+        {
+            for (size_t l=0; l<k; l++)
+            {
+                indicesR(i,l) = indices[i*k + l];
+                distancesR(i,l) = distances[i*k + l];
+            }
+        }
+        result = List::create(_["indices"]=indicesR, _["distances"]=distancesR);
+    }
+    else if (!Rf_isNull(_threshold))
+    {
+        std::vector<int> rows, cols;
+        std::vector<double> distances;
+        calculator.thresholded(*first, *second, as<double>(_threshold), rows, cols, distances);
+        toR(rows);
+        toR(cols);
+        result = List::create(_["i"]=rows, _["j"]=cols, _["distances"]=distances);
+    }
+    else
+    {
+        const std::vector<double> distances = calculator.matrix(*first, *second);
+        NumericMatrix matrix(first->size(), second->size());
+        std::copy(distances.begin(), distances.end(), matrix.begin());
+        result = matrix;
+    }
+    
+    // This also deletes the sinks
+    pipeline->reset();
+    if (otherPipeline != nullptr)
+        otherPipeline->reset();
+    
+    return result;
+END_RCPP
+}
+
+RcppExport SEXP profileStreamlines (SEXP _pipeline, SEXP _selection, SEXP _images, SEXP _interpolation, SEXP _binWidth, SEXP _maxDistance)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    pipeline->setSubset(_selection);
+    
+    const double binWidth = as<double>(_binWidth);
+    const double maxDistance = as<double>(_maxDistance);
+    if (binWidth <= 0.0)
+        throw Rcpp::exception("Bin width must be positive");
+    const ScalarProfileDataSink::InterpolationType interpolation = (as<std::string>(_interpolation) == "nearest" ? ScalarProfileDataSink::InterpolationType::Nearest : ScalarProfileDataSink::InterpolationType::Trilinear);
+    
+    // The images belong to the sink once it exists, but must be freed here if
+    // anything goes wrong before then
+    List imagesR(_images);
+    std::vector<Image<float,3> *> images;
+    ScalarProfileDataSink *profiler;
+    try
+    {
+        for (int i=0; i<imagesR.length(); i++)
+            images.push_back(new Image<float,3>(SEXP(imagesR[i])));
+        profiler = new ScalarProfileDataSink(images, interpolation, binWidth, maxDistance);
+    }
+    catch (...)
+    {
+        for (Image<float,3> *image : images)
+            delete image;
+        throw;
+    }
+    pipeline->addSink(profiler);
+    
+    RNGScope rng;
+    pipeline->run();
+    
+    List streamlineMeans, binMeans, binSDs, binCounts;
+    for (size_t i=0; i<profiler->nImages(); i++)
+    {
+        streamlineMeans.push_back(wrap(profiler->getStreamlineMeans(i)));
+        binMeans.push_back(wrap(profiler->getBinMeans(i)));
+        binSDs.push_back(wrap(profiler->getBinStandardDeviations(i)));
+        binCounts.push_back(wrap(profiler->getBinCounts(i)));
+    }
+    List result = List::create(_["binCentres"]=profiler->getBinCentres(), _["streamlineMeans"]=streamlineMeans, _["binMeans"]=binMeans, _["binSDs"]=binSDs, _["binCounts"]=binCounts);
+    
+    // The pipeline deletes the sink, and the sink deletes the images
+    pipeline->reset();
+    
+    return result;
+END_RCPP
+}
+
+static List connectivityResult (ConnectivityMatrixDataSink &matrix)
+{
+    // Seeds are returned in R's one-based voxel convention
+    const std::vector<ImageSpace::Point> &seeds = matrix.getSeeds();
+    NumericMatrix seedsR(seeds.size(), 3);
+    for (size_t i=0; i<seeds.size(); i++)
+    {
+        for (int j=0; j<3; j++)
+            seedsR(i,j) = seeds[i][j] + 1.0;
+    }
+    
+    std::vector<int> seedIndices, labels, counts;
+    matrix.getElements(seedIndices, labels, counts);
+    std::transform(seedIndices.begin(), seedIndices.end(), seedIndices.begin(), [](const int x) { return x+1; });
+    
+    const std::map<int,std::string> &dictionary = matrix.labelDictionary();
+    std::vector<int> labelValues;
+    std::vector<std::string> labelNames;
+    for (auto it=dictionary.cbegin(); it!=dictionary.cend(); it++)
+    {
+        labelValues.push_back(it->first);
+        labelNames.push_back(it->second);
+    }
+    IntegerVector labelsR = wrap(labelValues);
+    labelsR.attr("names") = labelNames;
+    
+    const std::vector<uint32_t> &totals = matrix.getTotals();
+    return List::create(_["seeds"]=seedsR, _["totals"]=std::vector<double>(totals.begin(), totals.end()), _["seed"]=seedIndices, _["label"]=labels, _["count"]=counts, _["labels"]=labelsR);
+}
+
+RcppExport SEXP runConnectivityPipeline (SEXP _pipeline, SEXP _path, SEXP _debugLevel)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    if (pipeline->dataSource()->type() != "tracker")
+        throw Rcpp::exception("A connectivity matrix requires a tracker source");
+    
+    TractographyDataSource *source = static_cast<TractographyDataSource *>(pipeline->dataSource());
+    Tracker *tracker = source->streamlineTracker();
+    tracker->setDebugLevel(as<int>(_debugLevel));
+    
+    ConnectivityMatrixDataSink *matrix = new ConnectivityMatrixDataSink(source->getSeeds());
+    matrix->labelDictionary() = tracker->labelDictionary();
+    pipeline->addSink(matrix);
+    
+    // For jitter and probabilistic interpolation
+    RNGScope rng;
+    pipeline->run();
+    
+    const std::string path = as<std::string>(_path);
+    if (!path.empty())
+        matrix->write(path);
+    List result = connectivityResult(*matrix);
+    
+    pipeline->reset();
+    
+    return result;
+END_RCPP
+}
+
+RcppExport SEXP readConnectivity (SEXP _path)
+{
+BEGIN_RCPP
+    ConnectivityMatrixDataSink matrix;
+    matrix.read(as<std::string>(_path));
+    return connectivityResult(matrix);
+END_RCPP
+}
+
+RcppExport SEXP runDensityPipeline (SEXP _pipeline, SEXP _selection, SEXP _factor, SEXP _weighting, SEXP _sparse, SEXP _refImage)
+{
+BEGIN_RCPP
+    Pipeline<Streamline> *pipeline = XPtr<Pipeline<Streamline>>(_pipeline).checked_get();
+    pipeline->setSubset(_selection);
+    
+    // The native space comes from the source or, failing that, a reference
+    // image, in which case it is freed on the way out even after an error
+    ImageSpace *space = nullptr;
+    std::unique_ptr<ImageSpace> ownedSpace;
+    const std::string sourceType = pipeline->dataSource()->type();
+    if (sourceType == "tracker")
+        space = static_cast<TractographyDataSource *>(pipeline->dataSource())->streamlineTracker()->getModel()->imageSpace();
+    else if (sourceType == "file")
+        space = static_cast<StreamlineFileSource *>(pipeline->dataSource())->imageSpace();
+    else if (sourceType == "list")
+        space = static_cast<RListDataSource *>(pipeline->dataSource())->imageSpace();
+    else if (sourceType == "columnar")
+        space = static_cast<RColumnarDataSource *>(pipeline->dataSource())->imageSpace();
+    if (space == nullptr && !Rf_isNull(_refImage))
+    {
+        const RNifti::NiftiImage image(_refImage, false, true);
+        ownedSpace.reset(new ImageSpace(image));
+        space = ownedSpace.get();
+    }
+    
+    const std::string weightingString = as<std::string>(_weighting);
+    TrackDensityDataSink::WeightingType weighting = TrackDensityDataSink::WeightingType::Count;
+    if (weightingString == "length")
+        weighting = TrackDensityDataSink::WeightingType::Length;
+    else if (weightingString == "direction")
+        weighting = TrackDensityDataSink::WeightingType::Direction;
+    
+    TrackDensityDataSink *density = new TrackDensityDataSink(space, as<double>(_factor), weighting);
+    pipeline->addSink(density);
+    
+    RNGScope rng;
+    const size_t count = pipeline->run();
+    
+    List result;
+    result["count"] = count;
+    if (as<bool>(_sparse))
+    {
+        // Sparse results carry the geometry separately; indices are one-based
+        std::vector<double> indices;
+        std::vector<std::vector<double>> values;
+        density->getElements(indices, values);
+        std::transform(indices.begin(), indices.end(), indices.begin(), [](const double x) { return x + 1.0; });
+        
+        const ImageSpace &fineSpace = density->imageSpace();
+        NumericMatrix xform(4, 4);
+        for (int i=0; i<4; i++)
+        {
+            for (int j=0; j<4; j++)
+                xform(i,j) = fineSpace.transform(i,j);
+        }
+        result["indices"] = indices;
+        result["values"] = values;
+        result["dim"] = fineSpace.dim;
+        result["pixdim"] = fineSpace.pixdim;
+        result["xform"] = xform;
+    }
+    else
+        result["map"] = density->toNifti().toPointer("track density map");
+    
+    pipeline->reset();
+    
+    return result;
+END_RCPP
+}